@@ -0,0 +1,1126 @@
+// End-to-end benchmark of yambar-bluetooth.
+//
+// A private dbus-daemon is started with a mock "org.bluez" service exposing a configurable number
+// of adapters and devices. The tool is spawned on this bus and the mock replays connect/disconnect
+// storms and discovery RSSI floods, while the blocks written by the tool on its stdout are timed.
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <systemd/sd-bus.h>
+#include <time.h>
+#include <unistd.h>
+
+#define str_eq(a, b) (strcmp((a), (b)) == 0)
+
+typedef struct
+{
+    const char *tool_path;
+    char **tool_arguments; // Extra arguments given to the tool, after "--".
+    int tool_arguments_count;
+    unsigned int adapters_count;
+    unsigned int devices_count; // Number of devices per adapter.
+    unsigned int toggles_count;
+    unsigned int storm_size;
+    unsigned int storms_count;
+    unsigned int flood_size;
+} bench_config;
+
+typedef struct
+{
+    char path[32];
+    bool powered;
+    bool discovering;
+} mock_adapter;
+
+typedef struct
+{
+    char path[64];
+    char address[18];
+    char name[32];
+    bool connected;
+    int16_t rssi;
+    unsigned int adapter;
+} mock_device;
+
+typedef struct
+{
+    char directory[64]; // Temporary directory holding the bus socket and configuration.
+    pid_t daemon_pid;
+    pid_t tool_pid;
+    sd_bus *bus;
+    int output_fd; // Read end of the tool stdout.
+
+    mock_adapter *adapters;
+    size_t adapters_count;
+    mock_device *devices;
+    size_t devices_count;
+
+    char *output;         // Bytes read from the tool which don't form a complete block yet.
+    size_t output_length;
+    size_t output_capacity;
+    char *block;          // Last complete block read from the tool.
+    uint64_t lines_count; // Total number of lines read from the tool.
+} bench_state;
+
+typedef struct
+{
+    uint64_t *values;
+    size_t count;
+} samples;
+
+static uint64_t now_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int add_sample(samples *samples, uint64_t value)
+{
+    uint64_t *values = realloc(samples->values, (samples->count + 1) * sizeof(uint64_t));
+    if (values == NULL)
+    {
+        fprintf(stderr, "Failed to allocate samples\n");
+        return -ENOMEM;
+    }
+
+    samples->values = values;
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+static uint64_t percentile(const samples *samples, unsigned int percent)
+{
+    if (samples->count == 0)
+    {
+        return 0;
+    }
+
+    size_t index = (samples->count * percent + 99) / 100;
+    return samples->values[index == 0 ? 0 : index - 1];
+}
+
+static void print_latencies(const char *name, samples *samples)
+{
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_uint64);
+    printf("%-8s latency (us): p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64 " (%zu samples)\n",
+           name, percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+           percentile(samples, 100), samples->count);
+}
+
+// CPU time (user and system) consumed by a process so far, in microseconds.
+static int read_cpu_time(pid_t pid, uint64_t *output)
+{
+    clockid_t clock;
+    struct timespec time;
+
+    if (clock_getcpuclockid(pid, &clock) != 0 || clock_gettime(clock, &time) < 0)
+    {
+        fprintf(stderr, "Failed to read CPU time of process %d\n", (int)pid);
+        return -EINVAL;
+    }
+
+    *output = (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+    return 0;
+}
+
+static void append_adapter_properties(sd_bus_message *message, const mock_adapter *adapter)
+{
+    sd_bus_message_append(message, "a{sv}", 3,
+                          "Powered", "b", adapter->powered,
+                          "Discovering", "b", adapter->discovering,
+                          "Name", "s", "mock");
+}
+
+static void append_device_properties(sd_bus_message *message, const bench_state *bench, const mock_device *device)
+{
+    sd_bus_message_append(message, "a{sv}", 8,
+                          "Address", "s", device->address,
+                          "Name", "s", device->name,
+                          "Alias", "s", device->name,
+                          "Icon", "s", "audio-headset",
+                          "Paired", "b", 1,
+                          "Connected", "b", device->connected,
+                          "RSSI", "n", device->rssi,
+                          "Adapter", "o", bench->adapters[device->adapter].path);
+}
+
+static int on_managed_objects_called(sd_bus_message *call, const bench_state *bench)
+{
+    sd_bus_message *reply = NULL;
+    int ret = 0;
+
+    ret = sd_bus_message_new_method_return(call, &reply);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "{oa{sa{sv}}}");
+
+    for (size_t i = 0; i < bench->adapters_count; i++)
+    {
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
+        sd_bus_message_append(reply, "o", bench->adapters[i].path);
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}");
+        sd_bus_message_append(reply, "s", "org.bluez.Adapter1");
+        append_adapter_properties(reply, &bench->adapters[i]);
+        sd_bus_message_close_container(reply);
+        sd_bus_message_close_container(reply);
+        sd_bus_message_close_container(reply);
+    }
+
+    for (size_t i = 0; i < bench->devices_count; i++)
+    {
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
+        sd_bus_message_append(reply, "o", bench->devices[i].path);
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}");
+        sd_bus_message_append(reply, "s", "org.bluez.Device1");
+        append_device_properties(reply, bench, &bench->devices[i]);
+        sd_bus_message_close_container(reply);
+        sd_bus_message_close_container(reply);
+        sd_bus_message_close_container(reply);
+    }
+
+    ret = sd_bus_message_close_container(reply);
+    if (ret >= 0)
+    {
+        ret = sd_bus_send(NULL, reply, NULL);
+    }
+
+    sd_bus_message_unref(reply);
+    return ret < 0 ? ret : 1;
+}
+
+static int on_get_all_called(sd_bus_message *call, const bench_state *bench)
+{
+    const char *path = sd_bus_message_get_path(call);
+    sd_bus_message *reply = NULL;
+    int ret = 0;
+
+    const char *interface;
+    ret = sd_bus_message_read(call, "s", &interface);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    const mock_adapter *adapter = NULL;
+    const mock_device *device = NULL;
+
+    if (str_eq(interface, "org.bluez.Adapter1"))
+    {
+        for (size_t i = 0; i < bench->adapters_count && adapter == NULL; i++)
+        {
+            adapter = str_eq(bench->adapters[i].path, path) ? &bench->adapters[i] : NULL;
+        }
+    }
+    else if (str_eq(interface, "org.bluez.Device1"))
+    {
+        for (size_t i = 0; i < bench->devices_count && device == NULL; i++)
+        {
+            device = str_eq(bench->devices[i].path, path) ? &bench->devices[i] : NULL;
+        }
+    }
+
+    if (adapter == NULL && device == NULL)
+    {
+        return sd_bus_reply_method_errorf(call, "org.freedesktop.DBus.Error.UnknownObject", "Unknown object '%s'", path);
+    }
+
+    ret = sd_bus_message_new_method_return(call, &reply);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    if (adapter != NULL)
+    {
+        append_adapter_properties(reply, adapter);
+    }
+    else
+    {
+        append_device_properties(reply, bench, device);
+    }
+
+    ret = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+    return ret < 0 ? ret : 1;
+}
+
+static int on_mock_called(sd_bus_message *call, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    const bench_state *bench = userdata;
+
+    if (sd_bus_message_is_method_call(call, "org.freedesktop.DBus.ObjectManager", "GetManagedObjects"))
+    {
+        return on_managed_objects_called(call, bench);
+    }
+    if (sd_bus_message_is_method_call(call, "org.freedesktop.DBus.Properties", "GetAll"))
+    {
+        return on_get_all_called(call, bench);
+    }
+
+    return 0;
+}
+
+static int emit_properties_changed(bench_state *bench, const char *path, const char *interface, const char *property, const char *type, ...)
+{
+    sd_bus_message *signal = NULL;
+    int ret = 0;
+
+    ret = sd_bus_message_new_signal(bench->bus, &signal, path, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create signal\n");
+        return ret;
+    }
+
+    va_list args;
+    va_start(args, type);
+    sd_bus_message_append(signal, "s", interface);
+    sd_bus_message_open_container(signal, SD_BUS_TYPE_ARRAY, "{sv}");
+    sd_bus_message_open_container(signal, SD_BUS_TYPE_DICT_ENTRY, "sv");
+    sd_bus_message_append(signal, "s", property);
+    sd_bus_message_open_container(signal, SD_BUS_TYPE_VARIANT, type);
+    if (type[0] == SD_BUS_TYPE_INT16)
+    {
+        int16_t value = (int16_t)va_arg(args, int);
+        sd_bus_message_append_basic(signal, SD_BUS_TYPE_INT16, &value);
+    }
+    else
+    {
+        int value = va_arg(args, int);
+        sd_bus_message_append_basic(signal, SD_BUS_TYPE_BOOLEAN, &value);
+    }
+    sd_bus_message_close_container(signal);
+    sd_bus_message_close_container(signal);
+    sd_bus_message_close_container(signal);
+    ret = sd_bus_message_append(signal, "as", 0);
+    va_end(args);
+
+    if (ret >= 0)
+    {
+        ret = sd_bus_send(bench->bus, signal, NULL);
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to send signal\n");
+    }
+
+    sd_bus_message_unref(signal);
+    return ret;
+}
+
+static int set_device_connected(bench_state *bench, mock_device *device, bool connected)
+{
+    device->connected = connected;
+    return emit_properties_changed(bench, device->path, "org.bluez.Device1", "Connected", "b", connected);
+}
+
+static int set_device_rssi(bench_state *bench, mock_device *device, int16_t rssi)
+{
+    device->rssi = rssi;
+    return emit_properties_changed(bench, device->path, "org.bluez.Device1", "RSSI", "n", rssi);
+}
+
+static int set_adapter_discovering(bench_state *bench, mock_adapter *adapter, bool discovering)
+{
+    adapter->discovering = discovering;
+    return emit_properties_changed(bench, adapter->path, "org.bluez.Adapter1", "Discovering", "b", discovering);
+}
+
+static int create_mock_objects(bench_state *bench, const bench_config *config)
+{
+    bench->adapters_count = config->adapters_count;
+    bench->devices_count = (size_t)config->adapters_count * config->devices_count;
+    bench->adapters = calloc(bench->adapters_count, sizeof(mock_adapter));
+    bench->devices = calloc(bench->devices_count, sizeof(mock_device));
+    if (bench->adapters == NULL || bench->devices == NULL)
+    {
+        fprintf(stderr, "Failed to allocate mock objects\n");
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < bench->adapters_count; i++)
+    {
+        mock_adapter *adapter = &bench->adapters[i];
+        snprintf(adapter->path, sizeof(adapter->path), "/org/bluez/hci%u", (unsigned int)i);
+        adapter->powered = true;
+        adapter->discovering = false;
+    }
+
+    for (size_t i = 0; i < bench->devices_count; i++)
+    {
+        mock_device *device = &bench->devices[i];
+        unsigned int adapter = i / config->devices_count;
+        unsigned int index = i % config->devices_count;
+        unsigned char bytes[6] = {0x10, adapter, 0, (index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff};
+
+        snprintf(device->address, sizeof(device->address), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+        snprintf(device->path, sizeof(device->path), "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X",
+                 bench->adapters[adapter].path, bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+        snprintf(device->name, sizeof(device->name), "Device %u", index);
+        device->connected = false;
+        device->rssi = -80;
+        device->adapter = adapter;
+    }
+
+    return 0;
+}
+
+static int write_daemon_config(const char *directory, char *config_path, size_t size)
+{
+    snprintf(config_path, size, "%s/bus.conf", directory);
+
+    FILE *file = fopen(config_path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to create '%s'\n", config_path);
+        return -errno;
+    }
+
+    fprintf(file,
+            "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+            " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+            "<busconfig>\n"
+            "  <type>session</type>\n"
+            "  <listen>unix:path=%s/bus.sock</listen>\n"
+            "  <auth>EXTERNAL</auth>\n"
+            "  <policy context=\"default\">\n"
+            "    <allow user=\"*\"/>\n"
+            "    <allow own=\"*\"/>\n"
+            "    <allow send_destination=\"*\"/>\n"
+            "    <allow receive_sender=\"*\"/>\n"
+            "  </policy>\n"
+            "</busconfig>\n",
+            directory);
+
+    return fclose(file) == 0 ? 0 : -errno;
+}
+
+static int start_bus_daemon(bench_state *bench, char *address, size_t size)
+{
+    int ret = 0;
+
+    char config_path[128];
+    ret = write_daemon_config(bench->directory, config_path, sizeof(config_path));
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        fprintf(stderr, "Failed to create pipe\n");
+        return -errno;
+    }
+
+    bench->daemon_pid = fork();
+    if (bench->daemon_pid < 0)
+    {
+        fprintf(stderr, "Failed to fork\n");
+        return -errno;
+    }
+    if (bench->daemon_pid == 0)
+    {
+        char config_argument[160];
+        char address_argument[32];
+        snprintf(config_argument, sizeof(config_argument), "--config-file=%s", config_path);
+        snprintf(address_argument, sizeof(address_argument), "--print-address=%d", fds[1]);
+        close(fds[0]);
+        execlp("dbus-daemon", "dbus-daemon", config_argument, "--nofork", "--nopidfile", address_argument, (char *)NULL);
+        fprintf(stderr, "Failed to execute dbus-daemon\n");
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    // The daemon prints its address once it's ready to accept connections.
+    size_t length = 0;
+    while (length < size - 1)
+    {
+        ssize_t count = read(fds[0], address + length, size - 1 - length);
+        if (count <= 0)
+        {
+            break;
+        }
+        length += count;
+        if (address[length - 1] == '\n')
+        {
+            break;
+        }
+    }
+    close(fds[0]);
+
+    address[length] = '\0';
+    if (length == 0)
+    {
+        fprintf(stderr, "Failed to read address of dbus-daemon\n");
+        return -EIO;
+    }
+    address[strcspn(address, "\n")] = '\0';
+
+    return 0;
+}
+
+static int start_mock_service(bench_state *bench, const char *address)
+{
+    int ret = 0;
+
+    ret = sd_bus_new(&bench->bus);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create bus\n");
+        return ret;
+    }
+
+    sd_bus_set_address(bench->bus, address);
+    sd_bus_set_bus_client(bench->bus, 1);
+
+    ret = sd_bus_start(bench->bus);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to connect to the private bus\n");
+        return ret;
+    }
+
+    ret = sd_bus_add_fallback(bench->bus, NULL, "/", on_mock_called, bench);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to register mock objects\n");
+        return ret;
+    }
+
+    ret = sd_bus_request_name(bench->bus, "org.bluez", 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to acquire 'org.bluez' name\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int start_tool(bench_state *bench, const bench_config *config, const char *address)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        fprintf(stderr, "Failed to create pipe\n");
+        return -errno;
+    }
+
+    bench->tool_pid = fork();
+    if (bench->tool_pid < 0)
+    {
+        fprintf(stderr, "Failed to fork\n");
+        return -errno;
+    }
+    if (bench->tool_pid == 0)
+    {
+        char **arguments = calloc(config->tool_arguments_count + 2, sizeof(char *));
+        arguments[0] = (char *)config->tool_path;
+        for (int i = 0; i < config->tool_arguments_count; i++)
+        {
+            arguments[i + 1] = config->tool_arguments[i];
+        }
+
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        setenv("DBUS_SYSTEM_BUS_ADDRESS", address, 1);
+        execv(config->tool_path, arguments);
+        fprintf(stderr, "Failed to execute '%s'\n", config->tool_path);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    bench->output_fd = fds[0];
+
+    return 0;
+}
+
+static int read_tool_output(bench_state *bench)
+{
+    if (bench->output_capacity - bench->output_length < 4096)
+    {
+        size_t capacity = bench->output_capacity == 0 ? 65536 : bench->output_capacity * 2;
+        char *output = realloc(bench->output, capacity);
+        if (output == NULL)
+        {
+            fprintf(stderr, "Failed to allocate output buffer\n");
+            return -ENOMEM;
+        }
+        bench->output = output;
+        bench->output_capacity = capacity;
+    }
+
+    ssize_t count = read(bench->output_fd, bench->output + bench->output_length, bench->output_capacity - bench->output_length - 1);
+    if (count < 0)
+    {
+        return errno == EINTR ? 0 : -errno;
+    }
+    if (count == 0)
+    {
+        fprintf(stderr, "The tool closed its output\n");
+        return -EPIPE;
+    }
+
+    for (ssize_t i = 0; i < count; i++)
+    {
+        bench->lines_count += bench->output[bench->output_length + i] == '\n';
+    }
+    bench->output_length += count;
+    bench->output[bench->output_length] = '\0';
+
+    return 0;
+}
+
+// Move the first complete block read from the tool to 'bench->block'. Blocks are terminated by
+// an empty line.
+static int extract_block(bench_state *bench, bool *output)
+{
+    char *end = strstr(bench->output == NULL ? "" : bench->output, "\n\n");
+    if (end == NULL)
+    {
+        *output = false;
+        return 0;
+    }
+    end += 2;
+
+    free(bench->block);
+    bench->block = strndup(bench->output, end - bench->output);
+    if (bench->block == NULL)
+    {
+        fprintf(stderr, "Failed to allocate block\n");
+        return -ENOMEM;
+    }
+
+    bench->output_length -= end - bench->output;
+    memmove(bench->output, end, bench->output_length + 1);
+    *output = true;
+
+    return 0;
+}
+
+// Whether one of the lines of the block is exactly 'line', so that e.g. "count|int|0" doesn't match
+// "hci0_count|int|0".
+static bool has_line(const char *block, const char *line)
+{
+    size_t length = strlen(line);
+    const char *start = block;
+
+    while (start != NULL && *start != '\0')
+    {
+        if (strncmp(start, line, length) == 0 && start[length] == '\n')
+        {
+            return true;
+        }
+
+        start = strchr(start, '\n');
+        start = start == NULL ? NULL : start + 1;
+    }
+
+    return false;
+}
+
+// Serve the mock objects until the tool prints a block with the 'expected' line (or any block if
+// NULL). The time at which the block was completely read is stored in 'output'.
+static int wait_for_block(bench_state *bench, const char *expected, uint64_t *output)
+{
+    int ret = 0;
+    uint64_t deadline = now_usec() + 10 * 1000000;
+
+    for (;;)
+    {
+        while ((ret = sd_bus_process(bench->bus, NULL)) > 0)
+        {
+        }
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to process mock bus\n");
+            return ret;
+        }
+
+        uint64_t now = now_usec();
+        if (now >= deadline)
+        {
+            fprintf(stderr, "Timed out waiting for '%s'\n", expected == NULL ? "any block" : expected);
+            return -ETIMEDOUT;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = bench->output_fd, .events = POLLIN},
+            {.fd = sd_bus_get_fd(bench->bus), .events = sd_bus_get_events(bench->bus)},
+        };
+        ret = poll(fds, 2, (int)((deadline - now) / 1000) + 1);
+        if (ret < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "Failed to poll\n");
+            return -errno;
+        }
+
+        if (fds[0].revents != 0)
+        {
+            ret = read_tool_output(bench);
+            if (ret < 0)
+            {
+                return ret;
+            }
+
+            bool has_block = true;
+            while (has_block)
+            {
+                ret = extract_block(bench, &has_block);
+                if (ret < 0)
+                {
+                    return ret;
+                }
+                if (has_block && (expected == NULL || has_line(bench->block, expected)))
+                {
+                    *output = now_usec();
+                    return 0;
+                }
+            }
+        }
+    }
+}
+
+static int send_and_flush(bench_state *bench)
+{
+    int ret = sd_bus_flush(bench->bus);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to flush mock bus\n");
+    }
+    return ret;
+}
+
+static int run_toggles(bench_state *bench, const bench_config *config)
+{
+    int ret = 0;
+    samples latencies = {NULL, 0};
+    mock_device *device = &bench->devices[0];
+
+    uint64_t cpu_start = 0;
+    uint64_t cpu_end = 0;
+    uint64_t lines_start = bench->lines_count;
+    read_cpu_time(bench->tool_pid, &cpu_start);
+
+    for (unsigned int i = 0; i < config->toggles_count; i++)
+    {
+        bool connected = !device->connected;
+        uint64_t start = now_usec();
+        uint64_t end = 0;
+
+        ret = set_device_connected(bench, device, connected);
+        if (ret >= 0)
+        {
+            ret = send_and_flush(bench);
+        }
+        if (ret >= 0)
+        {
+            ret = wait_for_block(bench, connected ? "connected|bool|true" : "connected|bool|false", &end);
+        }
+        if (ret >= 0)
+        {
+            ret = add_sample(&latencies, end - start);
+        }
+        if (ret < 0)
+        {
+            goto finish;
+        }
+    }
+
+    read_cpu_time(bench->tool_pid, &cpu_end);
+
+    print_latencies("toggle", &latencies);
+    printf("%-8s cpu=%.1f us/event, output=%.2f lines/event\n", "toggle",
+           (double)(cpu_end - cpu_start) / config->toggles_count,
+           (double)(bench->lines_count - lines_start) / config->toggles_count);
+
+finish:
+    free(latencies.values);
+    return ret;
+}
+
+static int run_storms(bench_state *bench, const bench_config *config)
+{
+    int ret = 0;
+    samples latencies = {NULL, 0};
+    unsigned int size = config->storm_size < config->devices_count ? config->storm_size : config->devices_count;
+    uint64_t events_count = 0;
+
+    uint64_t cpu_start = 0;
+    uint64_t cpu_end = 0;
+    uint64_t lines_start = bench->lines_count;
+    read_cpu_time(bench->tool_pid, &cpu_start);
+
+    for (unsigned int i = 0; i < config->storms_count * 2; i++)
+    {
+        bool connected = i % 2 == 0;
+        uint64_t start = now_usec();
+        uint64_t end = 0;
+
+        // The devices of the first adapter are (dis)connected all at once, like after a resume.
+        for (unsigned int j = 0; j < size && ret >= 0; j++)
+        {
+            ret = set_device_connected(bench, &bench->devices[j], connected);
+            events_count++;
+        }
+        if (ret >= 0)
+        {
+            ret = send_and_flush(bench);
+        }
+        if (ret >= 0)
+        {
+            char expected[32];
+            snprintf(expected, sizeof(expected), "count|int|%u", connected ? size : 0);
+            ret = wait_for_block(bench, expected, &end);
+        }
+        if (ret >= 0)
+        {
+            ret = add_sample(&latencies, end - start);
+        }
+        if (ret < 0)
+        {
+            goto finish;
+        }
+    }
+
+    read_cpu_time(bench->tool_pid, &cpu_end);
+
+    print_latencies("storm", &latencies);
+    printf("%-8s cpu=%.1f us/event, output=%.2f lines/event (%u devices per storm)\n", "storm",
+           (double)(cpu_end - cpu_start) / events_count,
+           (double)(bench->lines_count - lines_start) / events_count, size);
+
+finish:
+    free(latencies.values);
+    return ret;
+}
+
+static int run_flood(bench_state *bench, const bench_config *config)
+{
+    int ret = 0;
+    uint64_t end = 0;
+    mock_device *sentinel = &bench->devices[0];
+
+    ret = set_adapter_discovering(bench, &bench->adapters[0], true);
+    if (ret >= 0)
+    {
+        ret = send_and_flush(bench);
+    }
+    if (ret >= 0)
+    {
+        ret = wait_for_block(bench, "discovering|bool|true", &end);
+    }
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    uint64_t cpu_start = 0;
+    uint64_t cpu_end = 0;
+    uint64_t lines_start = bench->lines_count;
+    read_cpu_time(bench->tool_pid, &cpu_start);
+
+    uint64_t start = now_usec();
+    uint32_t random = 12345;
+
+    for (unsigned int i = 0; i < config->flood_size && ret >= 0; i++)
+    {
+        random = random * 1103515245 + 12345;
+        mock_device *device = &bench->devices[(random >> 8) % bench->devices_count];
+        ret = set_device_rssi(bench, device, -30 - (int16_t)((random >> 20) % 60));
+
+        // Serve the pending calls from time to time, so that the queues stay bounded.
+        if (ret >= 0 && i % 256 == 255)
+        {
+            ret = send_and_flush(bench);
+        }
+    }
+
+    // The flood is followed by a visible change, printed once all the signals were processed.
+    bool connected = !sentinel->connected;
+    if (ret >= 0)
+    {
+        ret = set_device_connected(bench, sentinel, connected);
+    }
+    if (ret >= 0)
+    {
+        ret = send_and_flush(bench);
+    }
+    if (ret >= 0)
+    {
+        ret = wait_for_block(bench, connected ? "connected|bool|true" : "connected|bool|false", &end);
+    }
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    read_cpu_time(bench->tool_pid, &cpu_end);
+
+    // The lines of the final block are caused by the sentinel, not by the flood.
+    uint64_t sentinel_lines = 0;
+    for (const char *c = bench->block; *c != '\0'; c++)
+    {
+        sentinel_lines += *c == '\n';
+    }
+
+    printf("%-8s drain=%" PRIu64 " us, cpu=%.2f us/event, output=%.4f lines/event (%u signals)\n", "flood",
+           end - start, (double)(cpu_end - cpu_start) / config->flood_size,
+           (double)(bench->lines_count - lines_start - sentinel_lines) / config->flood_size, config->flood_size);
+
+    ret = set_adapter_discovering(bench, &bench->adapters[0], false);
+    if (ret >= 0)
+    {
+        ret = send_and_flush(bench);
+    }
+    if (ret >= 0)
+    {
+        ret = wait_for_block(bench, "discovering|bool|false", &end);
+    }
+
+    return ret;
+}
+
+static int run_bench(const bench_config *config)
+{
+    int ret = 0;
+
+    bench_state bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.daemon_pid = -1;
+    bench.tool_pid = -1;
+    bench.output_fd = -1;
+
+    snprintf(bench.directory, sizeof(bench.directory), "/tmp/yambar-bluetooth-bench.XXXXXX");
+    if (mkdtemp(bench.directory) == NULL)
+    {
+        fprintf(stderr, "Failed to create temporary directory\n");
+        return -errno;
+    }
+
+    char address[256];
+    ret = start_bus_daemon(&bench, address, sizeof(address));
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to start dbus-daemon\n");
+        goto finish;
+    }
+
+    ret = create_mock_objects(&bench, config);
+    if (ret < 0)
+    {
+        goto finish;
+    }
+
+    ret = start_mock_service(&bench, address);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to start mock service\n");
+        goto finish;
+    }
+
+    printf("adapters=%u devices=%u\n", config->adapters_count, config->devices_count);
+
+    uint64_t start = now_usec();
+    uint64_t end = 0;
+
+    ret = start_tool(&bench, config, address);
+    if (ret >= 0)
+    {
+        ret = wait_for_block(&bench, NULL, &end);
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to start the tool\n");
+        goto finish;
+    }
+
+    printf("%-8s first output after %" PRIu64 " us\n", "startup", end - start);
+
+    ret = run_toggles(&bench, config);
+    if (ret >= 0)
+    {
+        ret = run_storms(&bench, config);
+    }
+    if (ret >= 0)
+    {
+        ret = run_flood(&bench, config);
+    }
+
+finish:
+    if (bench.tool_pid > 0)
+    {
+        kill(bench.tool_pid, SIGTERM);
+        waitpid(bench.tool_pid, NULL, 0);
+    }
+    if (bench.daemon_pid > 0)
+    {
+        kill(bench.daemon_pid, SIGTERM);
+        waitpid(bench.daemon_pid, NULL, 0);
+    }
+    if (bench.output_fd >= 0)
+    {
+        close(bench.output_fd);
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/bus.conf", bench.directory);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/bus.sock", bench.directory);
+    unlink(path);
+    rmdir(bench.directory);
+
+    sd_bus_unref(bench.bus);
+    free(bench.adapters);
+    free(bench.devices);
+    free(bench.output);
+    free(bench.block);
+
+    return ret;
+}
+
+static void print_help(const char *program_name)
+{
+    printf("Usage: %s --tool <path> [options] [-- <tool arguments>]\n", program_name);
+    printf("Options:\n");
+    printf("  -t, --tool <path>          Path of the yambar-bluetooth executable to benchmark\n");
+    printf("  -a, --adapters <count>     Number of mock adapters (default: 1)\n");
+    printf("  -n, --devices <count>      Number of mock devices per adapter (default: 100)\n");
+    printf("  -c, --toggles <count>      Number of connections and disconnections of one device (default: 200)\n");
+    printf("  -s, --storm-size <count>   Number of devices (dis)connected at once during a storm (default: 20)\n");
+    printf("  -r, --storms <count>       Number of connection and disconnection storms (default: 20)\n");
+    printf("  -f, --flood <count>        Number of RSSI signals sent during discovery (default: 10000)\n");
+    printf("  -h, --help                 Display this help message\n");
+}
+
+static int parse_count(const char *name, const char *value, unsigned int *output)
+{
+    char *end = NULL;
+    unsigned long result = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || result == 0 || result > 1000000)
+    {
+        fprintf(stderr, "Invalid value for option --%s: %s\n", name, value);
+        return -1;
+    }
+
+    *output = (unsigned int)result;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config config = {
+        .tool_path = NULL,
+        .tool_arguments = NULL,
+        .tool_arguments_count = 0,
+        .adapters_count = 1,
+        .devices_count = 100,
+        .toggles_count = 200,
+        .storm_size = 20,
+        .storms_count = 20,
+        .flood_size = 10000,
+    };
+
+    struct option long_options[] = {
+        {"tool", required_argument, NULL, 't'},
+        {"adapters", required_argument, NULL, 'a'},
+        {"devices", required_argument, NULL, 'n'},
+        {"toggles", required_argument, NULL, 'c'},
+        {"storm-size", required_argument, NULL, 's'},
+        {"storms", required_argument, NULL, 'r'},
+        {"flood", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int opt = 0;
+    int ret = 0;
+
+    while ((opt = getopt_long(argc, argv, "t:a:n:c:s:r:f:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            config.tool_path = optarg;
+            break;
+        case 'a':
+            ret = parse_count("adapters", optarg, &config.adapters_count);
+            break;
+        case 'n':
+            ret = parse_count("devices", optarg, &config.devices_count);
+            break;
+        case 'c':
+            ret = parse_count("toggles", optarg, &config.toggles_count);
+            break;
+        case 's':
+            ret = parse_count("storm-size", optarg, &config.storm_size);
+            break;
+        case 'r':
+            ret = parse_count("storms", optarg, &config.storms_count);
+            break;
+        case 'f':
+            ret = parse_count("flood", optarg, &config.flood_size);
+            break;
+        case 'h':
+            print_help(argv[0]);
+            return 0;
+        default:
+            return 1;
+        }
+
+        if (ret < 0)
+        {
+            return 1;
+        }
+    }
+
+    if (config.tool_path == NULL)
+    {
+        fprintf(stderr, "Missing --tool option\n");
+        return 1;
+    }
+
+    config.tool_arguments = argv + optind;
+    config.tool_arguments_count = argc - optind;
+
+    // The tool may exit before us, in which case its pipe must not kill the benchmark.
+    signal(SIGPIPE, SIG_IGN);
+
+    ret = run_bench(&config);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+        return 1;
+    }
+
+    return 0;
+}
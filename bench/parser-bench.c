@@ -0,0 +1,554 @@
+// Microbenchmark of the property parsers of yambar-bluetooth.
+//
+// Messages shaped like the replies of BlueZ ('a{oa{sa{sv}}}' for 'GetManagedObjects' and 'a{sv}'
+// for 'GetAll') are built in memory and parsed repeatedly, without any bus daemon involved. The
+// timings are reported per object and per property, so that parser changes can be compared.
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "properties.h"
+
+#define ADAPTER_PATH "/org/bluez/hci0"
+
+// Number of parses timed together for the small messages, which are too fast to be timed alone.
+#define DICT_BATCH 1000
+
+typedef struct
+{
+    unsigned int devices_count;
+    unsigned int rounds;
+} bench_config;
+
+typedef struct
+{
+    sd_bus_message *message;
+    unsigned int objects_count;
+    unsigned int properties_count; // Number of 'a{sv}' entries in the whole message.
+} bench_message;
+
+static const char *const device_uuids[] = {
+    "0000110b-0000-1000-8000-00805f9b34fb",
+    "0000110c-0000-1000-8000-00805f9b34fb",
+    "0000110e-0000-1000-8000-00805f9b34fb",
+    "0000111e-0000-1000-8000-00805f9b34fb",
+    "00001108-0000-1000-8000-00805f9b34fb",
+    NULL,
+};
+
+static uint64_t now_nsec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Messages can't be created on a bus which was never started, even though it's never used to
+// send them. A bus on one end of a socket pair is enough, the other end is closed right away.
+static int open_dummy_bus(sd_bus **output)
+{
+    sd_bus *bus = NULL;
+    int fds[2] = {-1, -1};
+    int ret = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds) < 0)
+    {
+        fprintf(stderr, "Failed to create socket pair\n");
+        return -errno;
+    }
+
+    ret = sd_bus_new(&bus);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create bus\n");
+        goto finish;
+    }
+
+    ret = sd_bus_set_fd(bus, fds[0], fds[0]);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to set bus socket\n");
+        goto finish;
+    }
+    fds[0] = -1;
+
+    ret = sd_bus_start(bus);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to start bus\n");
+        goto finish;
+    }
+
+    *output = bus;
+    bus = NULL;
+
+finish:
+    if (fds[0] >= 0)
+    {
+        close(fds[0]);
+    }
+    close(fds[1]);
+    sd_bus_unref(bus);
+
+    return ret;
+}
+
+static void append_empty_interface(sd_bus_message *message, const char *interface)
+{
+    sd_bus_message_append(message, "{sa{sv}}", interface, 0);
+}
+
+static unsigned int append_adapter_properties(sd_bus_message *message)
+{
+    sd_bus_message_append(message, "a{sv}", 14,
+                          "Address", "s", "00:1A:7D:DA:71:13",
+                          "AddressType", "s", "public",
+                          "Name", "s", "laptop",
+                          "Alias", "s", "laptop",
+                          "Class", "u", 0x6c010c,
+                          "Powered", "b", 1,
+                          "Discoverable", "b", 0,
+                          "DiscoverableTimeout", "u", 180,
+                          "Pairable", "b", 0,
+                          "PairableTimeout", "u", 0,
+                          "Discovering", "b", 0,
+                          "UUIDs", "as", 3, device_uuids[0], device_uuids[1], device_uuids[2],
+                          "Modalias", "s", "usb:v1D6Bp0246d0540",
+                          "Roles", "as", 2, "central", "peripheral");
+    return 14;
+}
+
+static unsigned int append_device_properties(sd_bus_message *message, unsigned int index)
+{
+    char address[18];
+    char name[32];
+
+    snprintf(address, sizeof(address), "10:00:00:%02X:%02X:%02X", (index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff);
+    snprintf(name, sizeof(name), "Device %u", index);
+
+    sd_bus_message_append(message, "a{sv}", 17,
+                          "Address", "s", address,
+                          "AddressType", "s", "public",
+                          "Name", "s", name,
+                          "Alias", "s", name,
+                          "Class", "u", 0x240404,
+                          "Icon", "s", "audio-headset",
+                          "Paired", "b", 1,
+                          "Bonded", "b", 1,
+                          "Trusted", "b", 1,
+                          "Blocked", "b", 0,
+                          "LegacyPairing", "b", 0,
+                          "RSSI", "n", -60,
+                          "Connected", "b", index % 10 == 0,
+                          "UUIDs", "as", 5, device_uuids[0], device_uuids[1], device_uuids[2], device_uuids[3], device_uuids[4],
+                          "Modalias", "s", "bluetooth:v004Cp4E20d0100",
+                          "Adapter", "o", ADAPTER_PATH,
+                          "ServicesResolved", "b", index % 10 == 0);
+    return 17;
+}
+
+static int create_message(sd_bus *bus, sd_bus_message **output)
+{
+    int ret = sd_bus_message_new(bus, output, SD_BUS_MESSAGE_METHOD_RETURN);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create message\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// The appends above don't check their result, a failure is reported when the message is sealed.
+static int seal_message(sd_bus_message *message)
+{
+    int ret = sd_bus_message_seal(message, 1, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to seal message\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// Same layout as the reply of BlueZ: the root object, the adapter and its devices, each of them
+// with the standard D-Bus interfaces which are skipped by the parser.
+static int build_managed_objects(sd_bus *bus, unsigned int devices_count, bench_message *output)
+{
+    sd_bus_message *message = NULL;
+    unsigned int properties = 0;
+    int ret = 0;
+
+    ret = create_message(bus, &message);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, "{oa{sa{sv}}}");
+
+    sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
+    sd_bus_message_append(message, "o", "/org/bluez");
+    sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+    append_empty_interface(message, "org.freedesktop.DBus.Introspectable");
+    append_empty_interface(message, "org.bluez.AgentManager1");
+    append_empty_interface(message, "org.bluez.ProfileManager1");
+    sd_bus_message_close_container(message);
+    sd_bus_message_close_container(message);
+
+    sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
+    sd_bus_message_append(message, "o", ADAPTER_PATH);
+    sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+    append_empty_interface(message, "org.freedesktop.DBus.Introspectable");
+    sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}");
+    sd_bus_message_append(message, "s", "org.bluez.Adapter1");
+    properties += append_adapter_properties(message);
+    sd_bus_message_close_container(message);
+    append_empty_interface(message, "org.freedesktop.DBus.Properties");
+    append_empty_interface(message, "org.bluez.GattManager1");
+    append_empty_interface(message, "org.bluez.Media1");
+    sd_bus_message_close_container(message);
+    sd_bus_message_close_container(message);
+
+    for (unsigned int i = 0; i < devices_count; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), ADAPTER_PATH "/dev_10_00_00_%02X_%02X_%02X", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+
+        sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
+        sd_bus_message_append(message, "o", path);
+        sd_bus_message_open_container(message, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+        append_empty_interface(message, "org.freedesktop.DBus.Introspectable");
+        sd_bus_message_open_container(message, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}");
+        sd_bus_message_append(message, "s", "org.bluez.Device1");
+        properties += append_device_properties(message, i);
+        sd_bus_message_close_container(message);
+        append_empty_interface(message, "org.freedesktop.DBus.Properties");
+        sd_bus_message_close_container(message);
+        sd_bus_message_close_container(message);
+    }
+
+    sd_bus_message_close_container(message);
+
+    ret = seal_message(message);
+    if (ret < 0)
+    {
+        sd_bus_message_unref(message);
+        return ret;
+    }
+
+    output->message = message;
+    output->objects_count = devices_count + 2;
+    output->properties_count = properties;
+    return 0;
+}
+
+static int build_adapter_properties(sd_bus *bus, bench_message *output)
+{
+    int ret = create_message(bus, &output->message);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    output->objects_count = 1;
+    output->properties_count = append_adapter_properties(output->message);
+    return seal_message(output->message);
+}
+
+static int build_device_properties(sd_bus *bus, bench_message *output)
+{
+    int ret = create_message(bus, &output->message);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    output->objects_count = 1;
+    output->properties_count = append_device_properties(output->message, 0);
+    return seal_message(output->message);
+}
+
+static int rewind_message(sd_bus_message *message)
+{
+    int ret = sd_bus_message_rewind(message, true);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to rewind message\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// 'samples' holds the duration of each round, divided by the number of parses done in the round.
+static void print_result(const char *name, const bench_message *message, uint64_t *samples, unsigned int rounds)
+{
+    qsort(samples, rounds, sizeof(uint64_t), compare_uint64);
+
+    uint64_t median = samples[rounds / 2];
+    uint64_t best = samples[0];
+
+    printf("%-8s %u objects, %u properties: %" PRIu64 " ns/parse, %" PRIu64 " ns/object, %" PRIu64 " ns/property"
+           " (best: %" PRIu64 " ns/object, %" PRIu64 " ns/property)\n",
+           name, message->objects_count, message->properties_count, median,
+           median / message->objects_count, median / message->properties_count,
+           best / message->objects_count, best / message->properties_count);
+}
+
+// Time the enumeration loop as done when the 'GetManagedObjects' reply is received, including the
+// insertions into the cache. The cache is cleared between rounds, outside of the timed section.
+static int run_managed_objects(const bench_message *message, unsigned int rounds)
+{
+    const char *namespaces[] = {ADAPTER_PATH};
+    bluetooth_cache cache;
+    int ret = 0;
+
+    uint64_t *samples = calloc(rounds, sizeof(uint64_t));
+    if (samples == NULL)
+    {
+        fprintf(stderr, "Failed to allocate samples\n");
+        return -ENOMEM;
+    }
+
+    init_bluetooth_cache(&cache);
+
+    for (unsigned int i = 0; i < rounds; i++)
+    {
+        ret = rewind_message(message->message);
+        if (ret < 0)
+        {
+            goto finish;
+        }
+
+        uint64_t start = now_nsec();
+        ret = parse_managed_objects(message->message, namespaces, 1, &cache);
+        samples[i] = now_nsec() - start;
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to parse managed objects\n");
+            goto finish;
+        }
+
+        clear_bluetooth_cache(&cache);
+    }
+
+    print_result("managed", message, samples, rounds);
+
+finish:
+    clear_bluetooth_cache(&cache);
+    free(samples);
+
+    return ret;
+}
+
+// Time a parser of a single 'a{sv}' dictionary. The rewind of the message is included in the
+// timings, but it's negligible compared to the parsing.
+static int run_properties(const char *name, const bench_message *message, unsigned int rounds, bool adapter)
+{
+    int ret = 0;
+
+    uint64_t *samples = calloc(rounds, sizeof(uint64_t));
+    if (samples == NULL)
+    {
+        fprintf(stderr, "Failed to allocate samples\n");
+        return -ENOMEM;
+    }
+
+    for (unsigned int i = 0; i < rounds; i++)
+    {
+        uint64_t start = now_nsec();
+
+        for (unsigned int j = 0; j < DICT_BATCH; j++)
+        {
+            ret = rewind_message(message->message);
+            if (ret < 0)
+            {
+                goto finish;
+            }
+
+            if (adapter)
+            {
+                adapter_info info;
+                init_adapter_info(&info);
+                ret = parse_adapter_properties(message->message, &info);
+            }
+            else
+            {
+                device_info info;
+                init_device_info(&info);
+                ret = parse_device_properties(message->message, &info);
+            }
+
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to parse %s properties\n", name);
+                goto finish;
+            }
+        }
+
+        samples[i] = (now_nsec() - start) / DICT_BATCH;
+    }
+
+    print_result(name, message, samples, rounds);
+
+finish:
+    free(samples);
+
+    return ret;
+}
+
+static int run_bench(const bench_config *config)
+{
+    sd_bus *bus = NULL;
+    bench_message managed = {NULL, 0, 0};
+    bench_message adapter = {NULL, 0, 0};
+    bench_message device = {NULL, 0, 0};
+    int ret = 0;
+
+    ret = open_dummy_bus(&bus);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to open dummy bus\n");
+        goto finish;
+    }
+
+    ret = build_managed_objects(bus, config->devices_count, &managed);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to build managed objects message\n");
+        goto finish;
+    }
+
+    ret = build_adapter_properties(bus, &adapter);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to build adapter properties message\n");
+        goto finish;
+    }
+
+    ret = build_device_properties(bus, &device);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to build device properties message\n");
+        goto finish;
+    }
+
+    ret = run_managed_objects(&managed, config->rounds);
+    if (ret < 0)
+    {
+        goto finish;
+    }
+
+    ret = run_properties("adapter", &adapter, config->rounds, true);
+    if (ret < 0)
+    {
+        goto finish;
+    }
+
+    ret = run_properties("device", &device, config->rounds, false);
+    if (ret < 0)
+    {
+        goto finish;
+    }
+
+finish:
+    sd_bus_message_unref(managed.message);
+    sd_bus_message_unref(adapter.message);
+    sd_bus_message_unref(device.message);
+    sd_bus_unref(bus);
+
+    return ret;
+}
+
+static void print_help(const char *program_name)
+{
+    printf("Usage: %s [options]\n", program_name);
+    printf("Options:\n");
+    printf("  -n, --devices <count>      Number of devices in the managed objects message (default: 100)\n");
+    printf("  -r, --rounds <count>       Number of timed rounds of each parser (default: 200)\n");
+    printf("  -h, --help                 Display this help message\n");
+}
+
+static int parse_count(const char *name, const char *value, unsigned int *output)
+{
+    char *end = NULL;
+    unsigned long result = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || result == 0 || result > 1000000)
+    {
+        fprintf(stderr, "Invalid value for option --%s: %s\n", name, value);
+        return -1;
+    }
+
+    *output = (unsigned int)result;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config config = {
+        .devices_count = 100,
+        .rounds = 200,
+    };
+
+    struct option long_options[] = {
+        {"devices", required_argument, NULL, 'n'},
+        {"rounds", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int opt = 0;
+    int ret = 0;
+
+    while ((opt = getopt_long(argc, argv, "n:r:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            ret = parse_count("devices", optarg, &config.devices_count);
+            break;
+        case 'r':
+            ret = parse_count("rounds", optarg, &config.rounds);
+            break;
+        case 'h':
+            print_help(argv[0]);
+            return 0;
+        default:
+            return 1;
+        }
+
+        if (ret < 0)
+        {
+            return 1;
+        }
+    }
+
+    ret = run_bench(&config);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1008 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BITS_PER_WORD 64
+
+static size_t hash_string_ref(string_ref ref)
+{
+    // Fibonacci hashing, the references are offsets which share their low bits too often.
+    return (size_t)(((uint64_t)ref * 11400714819323198485ULL) >> 32);
+}
+
+static bool get_bit(const uint64_t *bits, size_t index)
+{
+    return (bits[index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1;
+}
+
+static void set_bit(uint64_t *bits, size_t index, bool value)
+{
+    uint64_t mask = (uint64_t)1 << (index % BITS_PER_WORD);
+    bits[index / BITS_PER_WORD] = value ? bits[index / BITS_PER_WORD] | mask : bits[index / BITS_PER_WORD] & ~mask;
+}
+
+static void init_device_table(device_table *table)
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->paths = NULL;
+    table->names = NULL;
+    table->icons = NULL;
+    table->adapters = NULL;
+    table->addresses = NULL;
+    table->has_address = NULL;
+    table->connected = NULL;
+    table->paired = NULL;
+    table->rssi = NULL;
+    table->has_rssi = NULL;
+    table->nearby = NULL;
+    table->battery = NULL;
+    table->has_battery = NULL;
+    table->next = NULL;
+    table->buckets = NULL;
+}
+
+static void clear_device_table(device_table *table)
+{
+    free(table->paths);
+    free(table->names);
+    free(table->icons);
+    free(table->adapters);
+    free(table->addresses);
+    free(table->has_address);
+    free(table->connected);
+    free(table->paired);
+    free(table->rssi);
+    free(table->has_rssi);
+    free(table->nearby);
+    free(table->battery);
+    free(table->has_battery);
+    free(table->next);
+    free(table->buckets);
+    init_device_table(table);
+}
+
+void init_bluetooth_cache(bluetooth_cache *cache)
+{
+    cache->adapters = NULL;
+    cache->adapters_count = 0;
+    init_device_table(&cache->devices);
+    init_string_pool(&cache->strings);
+    cache->strings_compacted = 0;
+}
+
+void clear_bluetooth_cache(bluetooth_cache *cache)
+{
+    for (size_t i = 0; i < cache->adapters_count; i++)
+    {
+        free(cache->adapters[i].path);
+    }
+
+    free(cache->adapters);
+    clear_device_table(&cache->devices);
+    clear_string_pool(&cache->strings);
+    init_bluetooth_cache(cache);
+}
+
+cached_adapter *find_cached_adapter(const bluetooth_cache *cache, const char *path)
+{
+    for (size_t i = 0; i < cache->adapters_count; i++)
+    {
+        if (str_eq(cache->adapters[i].path, path))
+        {
+            return &cache->adapters[i];
+        }
+    }
+
+    return NULL;
+}
+
+int update_cached_adapter(bluetooth_cache *cache, const char *path, const adapter_info *changes)
+{
+    cached_adapter *adapter = find_cached_adapter(cache, path);
+
+    if (adapter == NULL)
+    {
+        char *path_copy = strdup(path);
+        cached_adapter *adapters = realloc(cache->adapters, (cache->adapters_count + 1) * sizeof(cached_adapter));
+        if (path_copy == NULL || adapters == NULL)
+        {
+            fprintf(stderr, "Failed to allocate cached adapter\n");
+            free(path_copy);
+            if (adapters != NULL)
+            {
+                cache->adapters = adapters;
+            }
+            return -ENOMEM;
+        }
+
+        cache->adapters = adapters;
+        adapter = &cache->adapters[cache->adapters_count++];
+        adapter->path = path_copy;
+        init_adapter_info(&adapter->info);
+    }
+
+    update_adapter_info(&adapter->info, changes);
+    return 0;
+}
+
+size_t find_cached_device(const bluetooth_cache *cache, const char *path)
+{
+    const device_table *table = &cache->devices;
+
+    // Paths are interned, a path which is not in the pool can't be the one of a device.
+    string_ref ref = find_string(&cache->strings, path);
+    if (ref == NO_STRING || table->capacity == 0)
+    {
+        return NO_DEVICE;
+    }
+
+    size_t index = table->buckets[hash_string_ref(ref) & (table->capacity - 1)];
+    while (index != NO_DEVICE && table->paths[index] != ref)
+    {
+        index = table->next[index];
+    }
+
+    return index;
+}
+
+static void link_cached_device(device_table *table, size_t index)
+{
+    size_t bucket = hash_string_ref(table->paths[index]) & (table->capacity - 1);
+    table->next[index] = table->buckets[bucket];
+    table->buckets[bucket] = index;
+}
+
+static void link_cached_devices(device_table *table)
+{
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        table->buckets[i] = NO_DEVICE;
+    }
+    for (size_t i = 0; i < table->count; i++)
+    {
+        link_cached_device(table, i);
+    }
+}
+
+static int grow_column(void **column, size_t size)
+{
+    void *grown = realloc(*column, size);
+    if (grown == NULL)
+    {
+        fprintf(stderr, "Failed to allocate device table\n");
+        return -ENOMEM;
+    }
+
+    *column = grown;
+    return 0;
+}
+
+static int grow_device_table(device_table *table)
+{
+    int ret = 0;
+
+    // The capacity is kept a power of two so that the bucket can be computed with a mask.
+    size_t capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    size_t words = capacity / BITS_PER_WORD;
+
+    // Columns already grown are simply larger than needed if a later one fails.
+    if ((ret = grow_column((void **)&table->paths, capacity * sizeof(string_ref))) < 0 ||
+        (ret = grow_column((void **)&table->names, capacity * sizeof(string_ref))) < 0 ||
+        (ret = grow_column((void **)&table->icons, capacity * sizeof(string_ref))) < 0 ||
+        (ret = grow_column((void **)&table->adapters, capacity * sizeof(string_ref))) < 0 ||
+        (ret = grow_column((void **)&table->addresses, capacity * sizeof(mac_address))) < 0 ||
+        (ret = grow_column((void **)&table->has_address, words * sizeof(uint64_t))) < 0 ||
+        (ret = grow_column((void **)&table->connected, words * sizeof(uint64_t))) < 0 ||
+        (ret = grow_column((void **)&table->paired, words * sizeof(uint64_t))) < 0 ||
+        (ret = grow_column((void **)&table->rssi, capacity * sizeof(int16_t))) < 0 ||
+        (ret = grow_column((void **)&table->has_rssi, words * sizeof(uint64_t))) < 0 ||
+        (ret = grow_column((void **)&table->nearby, words * sizeof(uint64_t))) < 0 ||
+        (ret = grow_column((void **)&table->battery, capacity * sizeof(uint8_t))) < 0 ||
+        (ret = grow_column((void **)&table->has_battery, words * sizeof(uint64_t))) < 0 ||
+        (ret = grow_column((void **)&table->next, capacity * sizeof(size_t))) < 0 ||
+        (ret = grow_column((void **)&table->buckets, capacity * sizeof(size_t))) < 0)
+    {
+        return ret;
+    }
+
+    // Unused bits are kept cleared, so that scans can look at whole words.
+    for (size_t i = table->capacity / BITS_PER_WORD; i < words; i++)
+    {
+        table->has_address[i] = 0;
+        table->connected[i] = 0;
+        table->paired[i] = 0;
+        table->has_rssi[i] = 0;
+        table->nearby[i] = 0;
+        table->has_battery[i] = 0;
+    }
+
+    table->capacity = capacity;
+    link_cached_devices(table);
+
+    return 0;
+}
+
+static string_ref *get_device_string_column(device_table *table, size_t column)
+{
+    string_ref *columns[] = {table->paths, table->names, table->icons, table->adapters};
+    return columns[column];
+}
+
+#define DEVICE_STRING_COLUMNS 4
+
+// The pool only grows, every rename leaves the previous name behind. It's rebuilt from the strings
+// still referenced once it's twice as large as after the previous rebuild, which keeps the memory
+// used bounded whatever the number of changes, for an amortized constant cost per change.
+static int compact_device_strings(bluetooth_cache *cache)
+{
+    int ret = 0;
+
+    device_table *table = &cache->devices;
+
+    string_pool strings;
+    init_string_pool(&strings);
+
+    for (size_t column = 0; column < DEVICE_STRING_COLUMNS; column++)
+    {
+        string_ref *refs = get_device_string_column(table, column);
+        for (size_t i = 0; i < table->count; i++)
+        {
+            if (refs[i] != NO_STRING)
+            {
+                ret = intern_string(&strings, get_string(&cache->strings, refs[i]), &refs[i]);
+                if (ret < 0)
+                {
+                    // The references already updated point into the new pool, nothing can be kept.
+                    fprintf(stderr, "Failed to compact device strings\n");
+                    clear_string_pool(&strings);
+                    return ret;
+                }
+            }
+        }
+    }
+
+    clear_string_pool(&cache->strings);
+    cache->strings = strings;
+    cache->strings_compacted = strings.length;
+
+    // The hash chains are indexed by the references of the paths, which all changed.
+    link_cached_devices(table);
+
+    return 0;
+}
+
+int update_cached_device_at(bluetooth_cache *cache, size_t index, const device_info *changes)
+{
+    int ret = 0;
+
+    device_table *table = &cache->devices;
+
+    if (changes->fields & DEVICE_CONNECTED)
+    {
+        set_bit(table->connected, index, changes->connected);
+    }
+    if (changes->fields & DEVICE_PAIRED)
+    {
+        set_bit(table->paired, index, changes->paired);
+    }
+    if (changes->fields & DEVICE_RSSI)
+    {
+        // BlueZ sends every advertisement it receives, whose RSSI jumps by several dB from one to
+        // the next. They are smoothed with an exponential moving average.
+        int sample = changes->rssi * 16;
+        table->rssi[index] = (int16_t)(get_bit(table->has_rssi, index) ? table->rssi[index] + (sample - table->rssi[index]) / 4 : sample);
+        set_bit(table->has_rssi, index, true);
+    }
+    if (changes->fields & DEVICE_ADDRESS)
+    {
+        set_bit(table->has_address, index, parse_mac_address(changes->address, &table->addresses[index]));
+    }
+    if (changes->fields & DEVICE_NAME)
+    {
+        ret = intern_string(&cache->strings, changes->name, &table->names[index]);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    if (changes->fields & DEVICE_ICON)
+    {
+        ret = intern_string(&cache->strings, changes->icon, &table->icons[index]);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    if (changes->fields & DEVICE_ADAPTER)
+    {
+        ret = intern_string(&cache->strings, changes->adapter, &table->adapters[index]);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    if (cache->strings.length > 2 * cache->strings_compacted + 4096)
+    {
+        ret = compact_device_strings(cache);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// Find the device, or add it with all its properties unknown.
+static int find_or_add_cached_device(bluetooth_cache *cache, const char *path, size_t *output)
+{
+    int ret = 0;
+
+    device_table *table = &cache->devices;
+
+    size_t index = find_cached_device(cache, path);
+
+    if (index == NO_DEVICE)
+    {
+        if (table->count == table->capacity)
+        {
+            ret = grow_device_table(table);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+
+        string_ref path_ref;
+        ret = intern_string(&cache->strings, path, &path_ref);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to allocate cached device\n");
+            return ret;
+        }
+
+        index = table->count++;
+        table->paths[index] = path_ref;
+        table->names[index] = NO_STRING;
+        table->icons[index] = NO_STRING;
+        table->adapters[index] = NO_STRING;
+        set_bit(table->has_address, index, false);
+        set_bit(table->connected, index, false);
+        set_bit(table->paired, index, false);
+        set_bit(table->has_rssi, index, false);
+        set_bit(table->nearby, index, false);
+        set_bit(table->has_battery, index, false);
+        link_cached_device(table, index);
+    }
+
+    *output = index;
+    return 0;
+}
+
+int update_cached_device(bluetooth_cache *cache, const char *path, const device_info *changes)
+{
+    int ret = 0;
+
+    size_t index;
+    ret = find_or_add_cached_device(cache, path, &index);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    return update_cached_device_at(cache, index, changes);
+}
+
+int update_cached_battery(bluetooth_cache *cache, const char *path, const battery_info *changes)
+{
+    int ret = 0;
+
+    // The interfaces of an object come in any order, the battery may be known before the device.
+    size_t index;
+    ret = find_or_add_cached_device(cache, path, &index);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    update_cached_battery_at(cache, index, changes);
+    return 0;
+}
+
+void update_cached_battery_at(bluetooth_cache *cache, size_t index, const battery_info *changes)
+{
+    device_table *table = &cache->devices;
+
+    if (changes->fields & BATTERY_PERCENTAGE)
+    {
+        table->battery[index] = changes->percentage;
+        set_bit(table->has_battery, index, true);
+    }
+}
+
+int get_cached_battery(const bluetooth_cache *cache, size_t index)
+{
+    const device_table *table = &cache->devices;
+    return get_bit(table->has_battery, index) ? table->battery[index] : -1;
+}
+
+void init_device_view(device_view *device)
+{
+    device->connected = false;
+    device->paired = false;
+    device->address[0] = '\0';
+    device->name = NULL;
+    device->icon = NULL;
+    device->battery = -1;
+}
+
+void get_cached_device(const bluetooth_cache *cache, size_t index, device_view *output)
+{
+    const device_table *table = &cache->devices;
+
+    output->connected = get_bit(table->connected, index);
+    output->paired = get_bit(table->paired, index);
+    output->address[0] = '\0';
+    if (get_bit(table->has_address, index))
+    {
+        format_mac_address(&table->addresses[index], output->address);
+    }
+    output->name = get_string(&cache->strings, table->names[index]);
+    output->icon = get_string(&cache->strings, table->icons[index]);
+    output->battery = get_cached_battery(cache, index);
+}
+
+// The scans below only look at the connected bits and at the adapter of the connected devices.
+size_t count_connected_devices(const bluetooth_cache *cache, const char *adapter)
+{
+    const device_table *table = &cache->devices;
+    size_t words = (table->count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    size_t count = 0;
+
+    if (adapter == NULL)
+    {
+        for (size_t i = 0; i < words; i++)
+        {
+            count += __builtin_popcountll(table->connected[i]);
+        }
+        return count;
+    }
+
+    string_ref adapter_ref = find_string(&cache->strings, adapter);
+    if (adapter_ref == NO_STRING)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < words; i++)
+    {
+        for (uint64_t bits = table->connected[i]; bits != 0; bits &= bits - 1)
+        {
+            count += table->adapters[i * BITS_PER_WORD + __builtin_ctzll(bits)] == adapter_ref;
+        }
+    }
+
+    return count;
+}
+
+size_t find_connected_device(const bluetooth_cache *cache, const char *adapter)
+{
+    const device_table *table = &cache->devices;
+    size_t words = (table->count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    string_ref adapter_ref = find_string(&cache->strings, adapter);
+    if (adapter_ref == NO_STRING)
+    {
+        return NO_DEVICE;
+    }
+
+    for (size_t i = 0; i < words; i++)
+    {
+        for (uint64_t bits = table->connected[i]; bits != 0; bits &= bits - 1)
+        {
+            size_t index = i * BITS_PER_WORD + __builtin_ctzll(bits);
+            if (table->adapters[index] == adapter_ref)
+            {
+                return index;
+            }
+        }
+    }
+
+    return NO_DEVICE;
+}
+
+size_t find_device_by_address(const bluetooth_cache *cache, const char *adapter, const mac_address *address)
+{
+    const device_table *table = &cache->devices;
+
+    string_ref adapter_ref = find_string(&cache->strings, adapter);
+    if (adapter_ref == NO_STRING)
+    {
+        return NO_DEVICE;
+    }
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        if (memcmp(&table->addresses[i], address, sizeof(mac_address)) == 0 && get_bit(table->has_address, i) && table->adapters[i] == adapter_ref)
+        {
+            return i;
+        }
+    }
+
+    return NO_DEVICE;
+}
+
+void forget_cached_device_rssi(bluetooth_cache *cache, size_t index)
+{
+    set_bit(cache->devices.has_rssi, index, false);
+    set_bit(cache->devices.nearby, index, false);
+}
+
+static int round_rssi(int rssi)
+{
+    return rssi < 0 ? -((8 - rssi) / 16) : (rssi + 8) / 16;
+}
+
+size_t update_nearby_devices(bluetooth_cache *cache, const char *adapter, int threshold, int *strongest)
+{
+    device_table *table = &cache->devices;
+    size_t words = (table->count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    size_t count = 0;
+
+    *strongest = NO_RSSI;
+
+    string_ref adapter_ref = find_string(&cache->strings, adapter);
+    if (adapter_ref == NO_STRING)
+    {
+        return 0;
+    }
+
+    // Only the devices seen by the discovery are looked at, which are few even when many are known.
+    for (size_t i = 0; i < words; i++)
+    {
+        for (uint64_t bits = table->has_rssi[i]; bits != 0; bits &= bits - 1)
+        {
+            size_t index = i * BITS_PER_WORD + __builtin_ctzll(bits);
+            if (table->adapters[index] != adapter_ref)
+            {
+                continue;
+            }
+
+            int rssi = round_rssi(table->rssi[index]);
+            bool nearby = rssi >= (get_bit(table->nearby, index) ? threshold - NEARBY_HYSTERESIS : threshold);
+            set_bit(table->nearby, index, nearby);
+
+            if (nearby)
+            {
+                count++;
+                *strongest = rssi > *strongest ? rssi : *strongest;
+            }
+        }
+    }
+
+    return count;
+}
+
+bool parse_mac_address(const char *text, mac_address *output)
+{
+    for (size_t i = 0; i < MAC_ADDRESS_SIZE; i++)
+    {
+        unsigned int byte = 0;
+        for (size_t j = 0; j < 2; j++)
+        {
+            char c = *text++;
+            unsigned int digit = c >= '0' && c <= '9'   ? (unsigned int)(c - '0')
+                                 : c >= 'A' && c <= 'F' ? (unsigned int)(c - 'A' + 10)
+                                 : c >= 'a' && c <= 'f' ? (unsigned int)(c - 'a' + 10)
+                                                        : 16;
+            if (digit == 16)
+            {
+                return false;
+            }
+            byte = byte * 16 + digit;
+        }
+
+        output->bytes[i] = (uint8_t)byte;
+
+        if (*text++ != (i + 1 < MAC_ADDRESS_SIZE ? ':' : '\0'))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void format_mac_address(const mac_address *address, char output[MAC_ADDRESS_TEXT_SIZE])
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    for (size_t i = 0; i < MAC_ADDRESS_SIZE; i++)
+    {
+        output[i * 3] = digits[address->bytes[i] >> 4];
+        output[i * 3 + 1] = digits[address->bytes[i] & 15];
+        output[i * 3 + 2] = i + 1 < MAC_ADDRESS_SIZE ? ':' : '\0';
+    }
+}
+
+bool remove_cached_adapter(bluetooth_cache *cache, const char *path)
+{
+    cached_adapter *adapter = find_cached_adapter(cache, path);
+    if (adapter == NULL)
+    {
+        return false;
+    }
+
+    free(adapter->path);
+    *adapter = cache->adapters[--cache->adapters_count];
+    return true;
+}
+
+// Remove the bit at 'index' from a bitset of 'count' bits, moving the following ones down.
+static void remove_bit(uint64_t *bits, size_t index, size_t count)
+{
+    size_t first = index / BITS_PER_WORD;
+    size_t last = (count - 1) / BITS_PER_WORD;
+    uint64_t below = ((uint64_t)1 << (index % BITS_PER_WORD)) - 1;
+    uint64_t kept = bits[first] & below;
+
+    for (size_t i = first; i <= last; i++)
+    {
+        uint64_t carry = i < last ? bits[i + 1] << (BITS_PER_WORD - 1) : 0;
+        bits[i] = (bits[i] >> 1) | carry;
+    }
+    bits[first] = (bits[first] & ~below) | kept;
+}
+
+// Remove the entry at 'index' from a column of 'count' entries, moving the following ones down.
+static void remove_entry(void *column, size_t size, size_t index, size_t count)
+{
+    char *entries = column;
+    memmove(entries + index * size, entries + (index + 1) * size, (count - index - 1) * size);
+}
+
+bool remove_cached_device(bluetooth_cache *cache, const char *path)
+{
+    device_table *table = &cache->devices;
+
+    size_t index = find_cached_device(cache, path);
+    if (index == NO_DEVICE)
+    {
+        return false;
+    }
+
+    // The following devices are moved down rather than the last one moved into the hole, so that
+    // the devices keep the order in which they were added, which 'find_connected_device()' relies
+    // on. The strings of the device stay in the pool until it's rebuilt.
+    remove_entry(table->paths, sizeof(*table->paths), index, table->count);
+    remove_entry(table->names, sizeof(*table->names), index, table->count);
+    remove_entry(table->icons, sizeof(*table->icons), index, table->count);
+    remove_entry(table->adapters, sizeof(*table->adapters), index, table->count);
+    remove_entry(table->addresses, sizeof(*table->addresses), index, table->count);
+    remove_entry(table->rssi, sizeof(*table->rssi), index, table->count);
+    remove_entry(table->battery, sizeof(*table->battery), index, table->count);
+    remove_bit(table->has_address, index, table->count);
+    remove_bit(table->connected, index, table->count);
+    remove_bit(table->paired, index, table->count);
+    remove_bit(table->has_rssi, index, table->count);
+    remove_bit(table->nearby, index, table->count);
+    remove_bit(table->has_battery, index, table->count);
+    table->count--;
+
+    // Every following device changed its index.
+    link_cached_devices(table);
+    return true;
+}
+
+bool remove_cached_battery(bluetooth_cache *cache, const char *path)
+{
+    size_t index = find_cached_device(cache, path);
+    if (index == NO_DEVICE || !get_bit(cache->devices.has_battery, index))
+    {
+        return false;
+    }
+
+    set_bit(cache->devices.has_battery, index, false);
+    return true;
+}
+
+void init_device_order(device_order *order)
+{
+    order->paths = NULL;
+    order->count = 0;
+    order->capacity = 0;
+}
+
+void clear_device_order(device_order *order)
+{
+    for (size_t i = 0; i < order->count; i++)
+    {
+        free(order->paths[i]);
+    }
+    free(order->paths);
+    init_device_order(order);
+}
+
+int update_device_order(device_order *order, const bluetooth_cache *cache, const char *adapter)
+{
+    const device_table *table = &cache->devices;
+    string_ref adapter_ref = find_string(&cache->strings, adapter);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < order->count; i++)
+    {
+        size_t index = find_cached_device(cache, order->paths[i]);
+        if (index != NO_DEVICE && get_bit(table->connected, index) && table->adapters[index] == adapter_ref)
+        {
+            order->paths[kept++] = order->paths[i];
+        }
+        else
+        {
+            free(order->paths[i]);
+        }
+    }
+    order->count = kept;
+
+    if (adapter_ref == NO_STRING)
+    {
+        return 0;
+    }
+
+    // Only a few devices are connected at once, a linear search is enough.
+    size_t words = (table->count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    for (size_t i = 0; i < words; i++)
+    {
+        for (uint64_t bits = table->connected[i]; bits != 0; bits &= bits - 1)
+        {
+            size_t index = i * BITS_PER_WORD + __builtin_ctzll(bits);
+            if (table->adapters[index] != adapter_ref)
+            {
+                continue;
+            }
+
+            const char *path = get_string(&cache->strings, table->paths[index]);
+
+            bool found = false;
+            for (size_t j = 0; j < kept && !found; j++)
+            {
+                found = str_eq(order->paths[j], path);
+            }
+            if (found)
+            {
+                continue;
+            }
+
+            if (order->count == order->capacity)
+            {
+                size_t capacity = order->capacity == 0 ? 4 : order->capacity * 2;
+                char **paths = realloc(order->paths, capacity * sizeof(char *));
+                if (paths == NULL)
+                {
+                    fprintf(stderr, "Failed to allocate device order\n");
+                    return -ENOMEM;
+                }
+                order->paths = paths;
+                order->capacity = capacity;
+            }
+
+            order->paths[order->count] = strdup(path);
+            if (order->paths[order->count] == NULL)
+            {
+                fprintf(stderr, "Failed to allocate device path\n");
+                return -ENOMEM;
+            }
+            order->count++;
+        }
+    }
+
+    return 0;
+}
+
+// Read the 'a{sa{sv}}' interfaces of a single object and store the ones we know about in the cache.
+int parse_object_interfaces(sd_bus_message *reply, const char *path, bool observed, bluetooth_cache *cache)
+{
+    int ret = 0;
+
+    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to enter interfaces array\n");
+        return ret;
+    }
+
+    for (;;)
+    {
+        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}");
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to enter interface dict entry\n");
+            return ret;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+
+        const char *interface;
+        ret = sd_bus_message_read(reply, "s", &interface);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to read interface name\n");
+            return ret;
+        }
+
+        if (str_eq(interface, "org.bluez.Adapter1") && observed)
+        {
+            adapter_info adapter;
+            init_adapter_info(&adapter);
+            ret = parse_adapter_properties(reply, &adapter);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to parse adapter properties\n");
+                return ret;
+            }
+
+            ret = update_cached_adapter(cache, path, &adapter);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to cache adapter properties\n");
+                return ret;
+            }
+        }
+        else if (str_eq(interface, "org.bluez.Battery1") && observed)
+        {
+            battery_info battery;
+            init_battery_info(&battery);
+            ret = parse_battery_properties(reply, &battery);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to parse battery properties\n");
+                return ret;
+            }
+
+            ret = update_cached_battery(cache, path, &battery);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to cache battery properties\n");
+                return ret;
+            }
+        }
+        else if (str_eq(interface, "org.bluez.Device1"))
+        {
+            device_info device;
+            init_device_info(&device);
+            ret = parse_device_properties(reply, &device);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to parse device properties\n");
+                return ret;
+            }
+
+            // Devices of the adapters which are not observed are only counted.
+            if (!observed)
+            {
+                device.fields &= DEVICE_CONNECTED;
+            }
+
+            ret = update_cached_device(cache, path, &device);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to cache device properties\n");
+                return ret;
+            }
+        }
+        else
+        {
+            ret = sd_bus_message_skip(reply, "a{sv}");
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to skip interface entry\n");
+                return ret;
+            }
+        }
+
+        ret = sd_bus_message_exit_container(reply);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to exit interface entry\n");
+            return ret;
+        }
+    }
+
+    ret = sd_bus_message_exit_container(reply);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to exit interfaces array\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+bool is_object_in_namespace(const char *path, const char *namespace)
+{
+    size_t length = strlen(namespace);
+    return strncmp(path, namespace, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+bool is_object_in_namespaces(const char *path, const char *const *namespaces, size_t namespaces_count)
+{
+    for (size_t i = 0; i < namespaces_count; i++)
+    {
+        if (is_object_in_namespace(path, namespaces[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Read the 'a{oa{sa{sv}}}' reply of 'GetManagedObjects' into the cache, where the objects in one of
+// the given namespaces are the observed ones. Returns the number of observed objects.
+int parse_managed_objects(sd_bus_message *reply, const char *const *namespaces, size_t namespaces_count,
+                          bluetooth_cache *cache)
+{
+    int observed_count = 0;
+    int ret = 0;
+
+    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{oa{sa{sv}}}");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to enter objects array\n");
+        return ret;
+    }
+
+    for (;;)
+    {
+        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to enter object dict entry\n");
+            return ret;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+
+        const char *path;
+        ret = sd_bus_message_read(reply, "o", &path);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to read object path\n");
+            return ret;
+        }
+
+        bool observed = is_object_in_namespaces(path, namespaces, namespaces_count);
+        observed_count += observed;
+
+        ret = parse_object_interfaces(reply, path, observed, cache);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to parse interfaces of object\n");
+            return ret;
+        }
+
+        ret = sd_bus_message_exit_container(reply);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to exit object dict entry\n");
+            return ret;
+        }
+    }
+
+    ret = sd_bus_message_exit_container(reply);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to exit objects array\n");
+        return ret;
+    }
+
+    return observed_count;
+}
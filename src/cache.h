@@ -0,0 +1,172 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <systemd/sd-bus.h>
+
+#include "pool.h"
+#include "properties.h"
+
+typedef struct
+{
+    char *path;          // D-Bus path of the adapter.
+    adapter_info info;
+} cached_adapter;
+
+#define NO_DEVICE SIZE_MAX
+
+#define MAC_ADDRESS_SIZE 6
+#define MAC_ADDRESS_TEXT_SIZE 18 // "AA:BB:CC:DD:EE:FF" and the terminating null character.
+
+typedef struct
+{
+    uint8_t bytes[MAC_ADDRESS_SIZE];
+} mac_address;
+
+// Devices are stored column by column, so that a scan over one property (e.g. finding the connected
+// devices) only touches the memory of that property. Strings are interned in the pool of the cache,
+// and booleans are stored as bitsets. Devices stay in the order they were added.
+typedef struct
+{
+    size_t count;
+    size_t capacity; // Always a power of two, or zero.
+    string_ref *paths;
+    string_ref *names;    // 'NO_STRING' if unknown.
+    string_ref *icons;    // 'NO_STRING' if unknown.
+    string_ref *adapters; // 'NO_STRING' if unknown.
+    mac_address *addresses;
+    uint64_t *has_address; // Whether the address is known.
+    uint64_t *connected;
+    uint64_t *paired;
+    int16_t *rssi;      // Smoothed RSSI, in sixteenths of dBm.
+    uint64_t *has_rssi; // Whether the RSSI is known, i.e. the device is currently seen by a discovery.
+    uint64_t *nearby;   // Whether the device was nearby when the tags were last printed.
+    uint8_t *battery;       // Percentage of the 'org.bluez.Battery1' interface.
+    uint64_t *has_battery;  // Whether the device has that interface.
+    size_t *next;    // Index of the next device in the same hash chain, or 'NO_DEVICE'.
+    size_t *buckets; // Head of each hash chain, indexed by the reference of the path.
+} device_table;
+
+// Copy of a device out of the table. The strings belong to the cache, they are only valid until
+// the cache is modified.
+typedef struct
+{
+    bool connected;
+    bool paired;
+    char address[MAC_ADDRESS_TEXT_SIZE]; // Empty if unknown.
+    const char *name;                    // NULL if unknown.
+    const char *icon;                    // NULL if unknown.
+    int battery;                         // Percentage, or -1 if unknown.
+} device_view;
+
+// State of the BlueZ objects we care about, indexed by object path. It's filled once with
+// 'GetManagedObjects' and then kept up to date from the signals.
+typedef struct
+{
+    cached_adapter *adapters;
+    size_t adapters_count;
+    device_table devices;
+    string_pool strings;
+    size_t strings_compacted; // Length of the pool when it was last rebuilt.
+} bluetooth_cache;
+
+void init_bluetooth_cache(bluetooth_cache *cache);
+
+void clear_bluetooth_cache(bluetooth_cache *cache);
+
+cached_adapter *find_cached_adapter(const bluetooth_cache *cache, const char *path);
+
+int update_cached_adapter(bluetooth_cache *cache, const char *path, const adapter_info *changes);
+
+// Index of the device in the table, or 'NO_DEVICE' if it's not in the cache.
+size_t find_cached_device(const bluetooth_cache *cache, const char *path);
+
+int update_cached_device(bluetooth_cache *cache, const char *path, const device_info *changes);
+
+// Same as 'update_cached_device()' for a device already in the cache.
+int update_cached_device_at(bluetooth_cache *cache, size_t index, const device_info *changes);
+
+// Store the battery of a device, which is added to the cache if it's not known yet.
+int update_cached_battery(bluetooth_cache *cache, const char *path, const battery_info *changes);
+
+// Same as 'update_cached_battery()' for a device already in the cache.
+void update_cached_battery_at(bluetooth_cache *cache, size_t index, const battery_info *changes);
+
+// Battery percentage of the device, or -1 if unknown.
+int get_cached_battery(const bluetooth_cache *cache, size_t index);
+
+void get_cached_device(const bluetooth_cache *cache, size_t index, device_view *output);
+
+// A device view of an unknown device, with every field empty.
+void init_device_view(device_view *device);
+
+// Number of connected devices of the adapter, or of all the adapters if it's NULL.
+size_t count_connected_devices(const bluetooth_cache *cache, const char *adapter);
+
+// First connected device of the adapter in the order they were added to the cache, or 'NO_DEVICE'.
+size_t find_connected_device(const bluetooth_cache *cache, const char *adapter);
+
+// Device of the adapter with the given address, connected or not, or 'NO_DEVICE'.
+size_t find_device_by_address(const bluetooth_cache *cache, const char *adapter, const mac_address *address);
+
+// Forget the RSSI of the device, which BlueZ invalidates once the device is not seen anymore.
+void forget_cached_device_rssi(bluetooth_cache *cache, size_t index);
+
+// RSSI reported when no device is nearby.
+#define NO_RSSI -127
+
+// Difference between the RSSI at which a device becomes nearby and the one at which it stops being
+// nearby, so that a device at the limit doesn't keep coming and going.
+#define NEARBY_HYSTERESIS 5
+
+// Update which devices of the adapter are nearby: they become nearby once their RSSI reaches
+// 'threshold' dBm, and stay nearby until it's 'NEARBY_HYSTERESIS' dB lower. Returns the number of
+// nearby devices, and stores their strongest RSSI in 'strongest' (or 'NO_RSSI' if there are none).
+size_t update_nearby_devices(bluetooth_cache *cache, const char *adapter, int threshold, int *strongest);
+
+// Read an address like "AA:BB:CC:DD:EE:FF", in any case. Returns false if it's malformed.
+bool parse_mac_address(const char *text, mac_address *output);
+
+void format_mac_address(const mac_address *address, char output[MAC_ADDRESS_TEXT_SIZE]);
+
+// Whether the object is 'namespace' itself or one of its descendants.
+bool is_object_in_namespace(const char *path, const char *namespace);
+
+bool is_object_in_namespaces(const char *path, const char *const *namespaces, size_t namespaces_count);
+
+bool remove_cached_adapter(bluetooth_cache *cache, const char *path);
+
+bool remove_cached_device(bluetooth_cache *cache, const char *path);
+
+// Forget the battery of a device whose 'org.bluez.Battery1' interface was removed.
+bool remove_cached_battery(bluetooth_cache *cache, const char *path);
+
+// Connected devices of an adapter, in the order they connected. Listing them in this order keeps
+// the devices which stay connected in place while others come and go.
+typedef struct
+{
+    char **paths;
+    size_t count;
+    size_t capacity;
+} device_order;
+
+void init_device_order(device_order *order);
+
+void clear_device_order(device_order *order);
+
+// Drop the devices which are not connected anymore, and append the ones which connected since.
+int update_device_order(device_order *order, const bluetooth_cache *cache, const char *adapter);
+
+// Read the 'a{sa{sv}}' interfaces of a single object and store the ones we know about in the cache.
+// Devices are kept wherever they are, so that they can all be counted, but only their connection
+// state is kept if the object is not 'observed', and the adapter and battery interfaces are skipped.
+int parse_object_interfaces(sd_bus_message *reply, const char *path, bool observed, bluetooth_cache *cache);
+
+// Read the 'a{oa{sa{sv}}}' reply of 'GetManagedObjects' into the cache, where the objects in one of
+// the given namespaces are the observed ones. Returns the number of observed objects.
+int parse_managed_objects(sd_bus_message *reply, const char *const *namespaces, size_t namespaces_count,
+                          bluetooth_cache *cache);
+
+#endif
@@ -0,0 +1,213 @@
+#include "client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "output.h"
+
+// Delay between two connection attempts, while the daemon is not running.
+#define RECONNECT_DELAY_US 1000000
+
+static int connect_to_daemon(const char *path)
+{
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create socket\n");
+        return -errno;
+    }
+
+    if (connect(fd, (const struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// Length of the first block of the data, including the empty line which terminates it, or 0 if
+// the block is not complete yet.
+static size_t find_block_end(const char *data, size_t length)
+{
+    for (size_t i = 1; i < length; i++)
+    {
+        if (data[i] == '\n' && data[i - 1] == '\n')
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+// Write the complete blocks at the start of the buffer, and remove them from it. A block identical
+// to the last one written is skipped, which happens when connecting again to a daemon.
+static int write_blocks(text_buffer *buffer, text_buffer *last)
+{
+    int ret = 0;
+    size_t start = 0;
+
+    for (;;)
+    {
+        const char *block = buffer->data + start;
+        size_t length = find_block_end(block, buffer->length - start);
+        if (length == 0)
+        {
+            break;
+        }
+        start += length;
+
+        if (length == last->length && memcmp(block, last->data, length) == 0)
+        {
+            continue;
+        }
+
+        ret = write_all(STDOUT_FILENO, block, length);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to write to stdout\n");
+            return ret;
+        }
+
+        ret = reserve_text(last, length);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        memcpy(last->data, block, length);
+        last->length = length;
+    }
+
+    memmove(buffer->data, buffer->data + start, buffer->length - start);
+    buffer->length -= start;
+    return 0;
+}
+
+// Relay the blocks of one connection. Only complete blocks are written, so that a daemon dying
+// in the middle of a block doesn't leave a truncated one on stdout. Writing to stdout may block,
+// in which case the daemon drops the blocks that get outdated meanwhile.
+static int relay_blocks(int fd, text_buffer *buffer, text_buffer *last)
+{
+    int ret = 0;
+
+    buffer->length = 0;
+
+    for (;;)
+    {
+        if (buffer->capacity - buffer->length < 1024)
+        {
+            ret = reserve_text(buffer, buffer->length + 4096);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+
+        ssize_t size = read(fd, buffer->data + buffer->length, buffer->capacity - buffer->length);
+        if (size < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Failed to read from daemon\n");
+            return 0;
+        }
+        if (size == 0)
+        {
+            fprintf(stderr, "Daemon disconnected\n");
+            return 0;
+        }
+        buffer->length += size;
+
+        ret = write_blocks(buffer, last);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+int run_block_client(const char *path)
+{
+    text_buffer buffer;
+    text_buffer last;
+    init_text_buffer(&buffer);
+    init_text_buffer(&last);
+
+    int ret = 0;
+    bool waiting = false;
+
+    for (;;)
+    {
+        int fd = connect_to_daemon(path);
+        if (fd == -ENOENT || fd == -ECONNREFUSED)
+        {
+            if (!waiting)
+            {
+                fprintf(stderr, "Waiting for a daemon to listen on %s\n", path);
+                waiting = true;
+            }
+            usleep(RECONNECT_DELAY_US);
+            continue;
+        }
+        if (fd < 0)
+        {
+            ret = fd;
+            fprintf(stderr, "Failed to connect to daemon\n");
+            break;
+        }
+
+        waiting = false;
+        ret = relay_blocks(fd, &buffer, &last);
+        close(fd);
+
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+
+    free_text_buffer(&buffer);
+    free_text_buffer(&last);
+
+    return ret;
+}
@@ -0,0 +1,8 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+// Relay the blocks published by a daemon on the given socket to stdout, until stdout is closed.
+// The daemon may be started after the client, or restarted, the client connects again.
+int run_block_client(const char *path);
+
+#endif
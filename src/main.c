@@ -1,804 +1,2303 @@
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <systemd/sd-bus.h>
+#include <time.h>
 #include <unistd.h>
 
-#define str_eq(a, b) (strcmp((a), (b)) == 0)
-#define str_eq_i(a, b) (strcasecmp(a, b) == 0)
+#include "cache.h"
+#include "client.h"
+#include "output.h"
+#include "persist.h"
+#include "server.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 
 typedef struct
 {
-    const char *adapter_object_path; // D-Bus path of the adapter. Can't be NULL.
-    const char *device_mac_address;  // MAC address of the device. If NULL, all devices are monitored.
+    const char *adapter_object_path; // D-Bus path of the main adapter, the one of the unprefixed tags. Can't be NULL.
+    const char **namespaces;         // Namespaces of the observed objects: the adapters, or all of BlueZ.
+    size_t namespaces_count;
+    bool multiple_adapters;          // Whether per-adapter and aggregate tags are printed.
+    bool all_adapters;               // Whether all the adapters are observed, instead of the given ones.
+    bool has_device_address;         // Whether a single device is observed. Otherwise, the first connected one is.
+    mac_address device_address;      // MAC address of the observed device, if any.
+    const char *device_object_path;  // D-Bus path of the device, derived from its MAC address. Can be NULL.
+    unsigned int settle_ms;          // Delay during which changes are accumulated before being printed.
+    unsigned int max_devices;        // Number of connected devices listed with indexed tags, or 0.
+    bool nearby;                     // Whether the devices seen by a discovery are counted.
+    int nearby_threshold;            // RSSI (in dBm) from which a device is nearby.
+    unsigned int rssi_interval_ms;   // Minimum delay between two blocks printed because of RSSI changes.
+    unsigned int battery_delta;      // Smallest change of a battery percentage which is printed.
+    unsigned int stats_interval;     // Interval (in seconds) between dumps of the statistics, or 0.
+    bool daemon;                     // Whether the tags are published on a socket instead of stdout.
+    bool client;                     // Whether the tags are relayed from a daemon to stdout.
+    const char *socket_path;         // Socket of the daemon, used in daemon and client modes.
+    bool snapshot;                   // Whether the state is also published in a memory-mapped file.
+    const char *snapshot_path;       // File in which the state is published.
+    bool warm_start;                 // Whether the last block of the previous run is printed at startup.
+    const char *warm_start_path;     // File in which the last block is saved for the next run.
 } monitoring_config;
 
+typedef struct properties_request properties_request;
+
+typedef struct
+{
+    const monitoring_config *config;
+    bluetooth_cache cache;
+    device_order device_order; // Connected devices listed with indexed tags, in connection order.
+    text_buffer rendered; // Scratch buffer in which the tags are formatted.
+    text_buffer emitted;  // Last block given to the output, to skip identical ones.
+    output_sink output;   // Non-blocking stdout, in standalone mode.
+    block_server server;  // Socket on which the tags are published, in daemon mode.
+    snapshot_writer snapshot; // Memory-mapped file in which the state is published, if enabled.
+    bool persisting;      // Whether the blocks are saved for the next run, until saving fails once.
+    bool persisted_shown; // Whether the last block given to the output is the one saved by the previous run.
+    uint64_t persisted_until; // Monotonic time (in microseconds) until which that block is kept while BlueZ is missing.
+    bool persist_pending; // Whether the last block given to the output isn't saved yet.
+    uint64_t persist_at;  // Monotonic time (in microseconds) at which it's saved.
+    bool available;       // Whether BlueZ answered on the current connection and is still running.
+    uint64_t reconnect_at;    // Monotonic time (in microseconds) of the next connection attempt to the bus.
+    uint64_t reconnect_delay; // Delay before the next attempt if the connection fails again.
+    struct pollfd *poll_fds;
+    size_t poll_fds_capacity;
+    bool dirty;           // Whether the cache changed since the tags were last printed.
+    uint64_t dirty_since; // Monotonic time (in microseconds) of the first change not printed yet.
+    bool rssi_dirty;          // Whether an RSSI changed since the tags were last printed.
+    uint64_t rssi_dirty_since; // Monotonic time (in microseconds) of the first RSSI change not printed yet.
+    uint64_t rssi_printed_at; // Monotonic time (in microseconds) at which the RSSI were last printed.
+    bool fetch_pending;   // Whether a 'GetManagedObjects' call is waiting for its reply.
+    bool fetch_again;     // Whether another enumeration was requested while a call was pending.
+    int error;            // Error raised by an asynchronous callback, which stops the monitoring.
+    properties_request *properties_requests; // Pending 'GetAll' calls for invalidated properties.
+    bool enumerated;               // Whether a 'GetManagedObjects' reply was received.
+    unsigned int initial_requests; // Number of pending 'GetAll' calls the first frame waits for.
+    unsigned int pending_matches;  // Number of match rules not confirmed by the bus daemon yet.
+    uint64_t fetch_started_at;     // Monotonic time (in microseconds) of the pending 'GetManagedObjects' call.
+    monitoring_stats stats;
+} monitoring_context;
+
+// A pending 'Properties.GetAll' call for a single object, used to read properties that were
+// invalidated by a 'PropertiesChanged' signal instead of being sent with their new value.
+struct properties_request
+{
+    properties_request *next;
+    monitoring_context *context;
+    char *path;
+    const char *interface;
+    sd_bus_slot *slot; // The pending call, which is cancelled if the request is dropped.
+    bool again;   // Whether more properties were invalidated while the call was pending.
+    bool initial; // Whether the call is part of the targeted fetch done at startup.
+};
+
+// Whether the object is one of the observed adapters itself or one of their devices.
+static bool is_observed_object(const monitoring_config *config, const char *path)
+{
+    return is_object_in_namespaces(path, config->namespaces, config->namespaces_count);
+}
+
+// Upper bound of '--max-devices', which is only meant for the few devices shown on a bar.
+#define MAX_LISTED_DEVICES 16
+
+// Defaults of '--nearby' and '--rssi-interval'. During a discovery, BlueZ sends the RSSI of every
+// advertisement it receives, there is no point in redrawing the bar at that rate.
+#define DEFAULT_NEARBY_THRESHOLD -80
+#define DEFAULT_RSSI_INTERVAL_MS 1000
+
+// Upper bound of the adapters which get prefixed tags.
+#define MAX_ADAPTERS 8
+
+#define BLUEZ_PATH_PREFIX "/org/bluez/"
+
 typedef struct
 {
+    const char *name; // Path of the adapter without the BlueZ prefix, e.g. "hci0".
     bool powered;
     bool discovering;
-} adapter_info;
+    int connected_count;
+} adapter_summary;
 
+// What the tags describe. The strings are borrowed from the cache.
 typedef struct
 {
-    bool connected;
-    const char *address;
-    const char *name;
-    const char *icon;
-    const char *adapter;
-} device_info;
-
-static void init_adapter_info(adapter_info *adapter)
+    bool available;
+    adapter_info adapter;
+    device_view device;
+    int connected_count; // Devices connected to any adapter, observed or not.
+    unsigned int listed_slots; // Number of indexed device tags to print.
+    unsigned int listed_count; // Number of slots actually used by a connected device.
+    device_view listed[MAX_LISTED_DEVICES];
+    int nearby_count;
+    int strongest_rssi;
+    bool powered_any;
+    int connected_total;
+    size_t adapters_count; // Number of adapters with prefixed tags, 0 unless several are observed.
+    adapter_summary adapters[MAX_ADAPTERS];
+} bluetooth_state;
+
+static const char *get_adapter_name(const char *path)
 {
-    adapter->powered = false;
-    adapter->discovering = false;
+    return strncmp(path, BLUEZ_PATH_PREFIX, strlen(BLUEZ_PATH_PREFIX)) == 0 ? path + strlen(BLUEZ_PATH_PREFIX) : path;
 }
 
-static void init_device_info(device_info *device)
+// The adapters are the given ones in the given order, even if they are missing, or the ones found.
+static void collect_adapter_summaries(const monitoring_context *context, bluetooth_state *output)
 {
-    device->connected = false;
-    device->address = NULL;
-    device->name = NULL;
-    device->icon = NULL;
-    device->adapter = NULL;
-}
+    const monitoring_config *config = context->config;
+    const bluetooth_cache *cache = &context->cache;
 
-static int read_boolean_variant(sd_bus_message *reply, bool *value)
-{
-    int ret = 0;
+    const char *paths[MAX_ADAPTERS];
+    size_t count = 0;
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_VARIANT, "b");
-    if (ret < 0)
+    if (config->all_adapters)
     {
-        fprintf(stderr, "Failed to enter boolean variant container");
-        return ret;
+        for (size_t i = 0; i < cache->adapters_count && count < MAX_ADAPTERS; i++)
+        {
+            paths[count++] = cache->adapters[i].path;
+        }
     }
-
-    int intValue; // Documentation requires 'int' and not 'bool'.
-    ret = sd_bus_message_read(reply, "b", &intValue);
-    if (ret < 0)
+    else
     {
-        fprintf(stderr, "Failed to read boolean variant\n");
-        return ret;
+        for (size_t i = 0; i < config->namespaces_count && count < MAX_ADAPTERS; i++)
+        {
+            paths[count++] = config->namespaces[i];
+        }
     }
 
-    ret = sd_bus_message_exit_container(reply);
-    if (ret < 0)
+    output->powered_any = false;
+    output->connected_total = 0;
+    output->adapters_count = count;
+
+    for (size_t i = 0; i < count; i++)
     {
-        fprintf(stderr, "Failed to exit boolean variant container");
-        return ret;
+        const cached_adapter *adapter = find_cached_adapter(cache, paths[i]);
+        adapter_summary *summary = &output->adapters[i];
+        summary->name = get_adapter_name(paths[i]);
+        summary->powered = adapter != NULL && adapter->info.powered;
+        summary->discovering = adapter != NULL && adapter->info.discovering;
+        summary->connected_count = (int)count_connected_devices(cache, paths[i]);
+        output->powered_any |= summary->powered;
     }
 
-    *value = intValue;
-    return 0;
+    // The cache also holds the devices of the adapters which are not observed.
+    if (config->all_adapters)
+    {
+        output->connected_total = (int)count_connected_devices(cache, NULL);
+    }
+    else
+    {
+        for (size_t i = 0; i < config->namespaces_count; i++)
+        {
+            output->connected_total += (int)count_connected_devices(cache, config->namespaces[i]);
+        }
+    }
 }
 
-static int read_object_path_variant(sd_bus_message *reply, const char **value)
+static void collect_bluetooth_state(const monitoring_context *context, bluetooth_state *output)
 {
-    int ret = 0;
+    const monitoring_config *config = context->config;
+    const bluetooth_cache *cache = &context->cache;
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_VARIANT, "o");
-    if (ret < 0)
-    {
-        fprintf(stderr, "Failed to enter object path variant container");
-        return ret;
-    }
+    output->available = context->available;
 
-    ret = sd_bus_message_read(reply, "o", value);
-    if (ret < 0)
+    init_adapter_info(&output->adapter);
+
+    const cached_adapter *adapter = find_cached_adapter(cache, config->adapter_object_path);
+    if (adapter != NULL)
     {
-        fprintf(stderr, "Failed to read object path variant\n");
-        return ret;
+        output->adapter = adapter->info;
     }
 
-    ret = sd_bus_message_exit_container(reply);
-    if (ret < 0)
+    size_t device = config->has_device_address
+                        ? find_device_by_address(cache, config->adapter_object_path, &config->device_address)
+                        : find_connected_device(cache, config->adapter_object_path);
+
+    init_device_view(&output->device);
+    if (device != NO_DEVICE)
     {
-        fprintf(stderr, "Failed to exit object path variant container");
-        return ret;
+        get_cached_device(cache, device, &output->device);
     }
 
-    return 0;
-}
+    output->connected_count = (int)count_connected_devices(cache, NULL);
 
-static int read_string_variant(sd_bus_message *reply, const char **value)
-{
-    int ret = 0;
+    // The order is updated before the tags are printed, every listed device is in the cache.
+    const device_order *order = &context->device_order;
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_VARIANT, "s");
-    if (ret < 0)
-    {
-        fprintf(stderr, "Failed to enter string variant container");
-        return ret;
-    }
+    output->listed_slots = config->max_devices;
+    output->listed_count = 0;
 
-    ret = sd_bus_message_read(reply, "s", value);
-    if (ret < 0)
+    for (size_t i = 0; i < order->count && output->listed_count < output->listed_slots; i++)
     {
-        fprintf(stderr, "Failed to read string variant\n");
-        return ret;
+        get_cached_device(cache, find_cached_device(cache, order->paths[i]), &output->listed[output->listed_count++]);
     }
 
-    ret = sd_bus_message_exit_container(reply);
-    if (ret < 0)
+    output->nearby_count = 0;
+    output->strongest_rssi = NO_RSSI;
+
+    output->adapters_count = 0;
+    if (config->multiple_adapters)
     {
-        fprintf(stderr, "Failed to exit string variant container");
-        return ret;
+        collect_adapter_summaries(context, output);
     }
-
-    return 0;
 }
 
-static int parse_adapter_properties(sd_bus_message *reply, adapter_info *output)
+// With '--warm-start', the blocks end with a 'stale' tag, which is only true for the block saved
+// by the previous run and printed at startup.
+#define STALE_TAG_FALSE "stale|bool|false\n\n"
+#define STALE_TAG_TRUE "stale|bool|true\n\n"
+
+// Delay between a block given to the output and its saving for the next run, which is also the
+// shortest interval between two writes of the file.
+#define PERSIST_DELAY_US 5000000
+
+// Longest time the block saved by the previous run is shown while BlueZ doesn't answer.
+#define PERSISTED_SHOWN_MAX_US 10000000
+
+static int format_bluetooth_state(const bluetooth_state *state, const monitoring_config *config, text_buffer *output)
 {
     int ret = 0;
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sv}");
+    const adapter_info *found_adapter = &state->adapter;
+    const device_view *found_device = &state->device;
+
+    output->length = 0;
+
+    ret = append_text(output,
+                       "powered|bool|%s\n"
+                       "discovering|bool|%s\n"
+                       "connected|bool|%s\n"
+                       "count|int|%d\n"
+                       "address|string|%s\n"
+                       "name|string|%s\n"
+                       "icon|string|%s\n"
+                       "available|bool|%s\n"
+                       "has_battery|bool|%s\n"
+                       "battery|range:0-100|%d\n",
+                       found_adapter->powered ? "true" : "false",
+                       found_adapter->discovering ? "true" : "false",
+                       found_device->connected ? "true" : "false",
+                       state->connected_count,
+                       found_device->address,
+                       found_device->name == NULL ? "" : found_device->name,
+                       found_device->icon == NULL ? "" : found_device->icon,
+                       state->available ? "true" : "false",
+                       found_device->battery >= 0 ? "true" : "false",
+                       found_device->battery >= 0 ? found_device->battery : 0);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to enter properties array of adapter\n");
         return ret;
     }
 
-    for (;;)
+    if (config->nearby)
     {
-        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sv");
+        ret = append_text(output,
+                          "nearby|int|%d\n"
+                          "rssi|int|%d\n",
+                          state->nearby_count,
+                          state->strongest_rssi);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to enter dict entry of adapter properties\n");
             return ret;
         }
-        if (ret == 0)
-        {
-            break;
-        }
+    }
 
-        const char *property;
-        ret = sd_bus_message_read(reply, "s", &property);
+    if (state->adapters_count > 0)
+    {
+        ret = append_text(output,
+                          "powered_any|bool|%s\n"
+                          "count_total|int|%d\n",
+                          state->powered_any ? "true" : "false",
+                          state->connected_total);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to read adapter property name\n");
             return ret;
         }
+    }
 
-        if (str_eq(property, "Powered"))
-        {
-            ret = read_boolean_variant(reply, &output->powered);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Powered' property\n");
-                return ret;
-            }
-        }
-        else if (str_eq(property, "Discovering"))
-        {
-            ret = read_boolean_variant(reply, &output->discovering);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Discovering' property\n");
-                return ret;
-            }
-        }
-        else
+    for (size_t i = 0; i < state->adapters_count; i++)
+    {
+        const adapter_summary *adapter = &state->adapters[i];
+
+        ret = append_text(output,
+                          "%s_powered|bool|%s\n"
+                          "%s_discovering|bool|%s\n"
+                          "%s_count|int|%d\n",
+                          adapter->name, adapter->powered ? "true" : "false",
+                          adapter->name, adapter->discovering ? "true" : "false",
+                          adapter->name, adapter->connected_count);
+        if (ret < 0)
         {
-            ret = sd_bus_message_skip(reply, "v");
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to skip variant\n");
-                return ret;
-            }
+            return ret;
         }
+    }
 
-        ret = sd_bus_message_exit_container(reply);
+    // Unused slots are printed too, so that the tags of a disconnected device are cleared.
+    for (unsigned int i = 0; i < state->listed_slots; i++)
+    {
+        const device_view *device = i < state->listed_count ? &state->listed[i] : NULL;
+
+        ret = append_text(output,
+                          "device%u_connected|bool|%s\n"
+                          "device%u_address|string|%s\n"
+                          "device%u_name|string|%s\n"
+                          "device%u_icon|string|%s\n",
+                          i, device != NULL ? "true" : "false",
+                          i, device == NULL ? "" : device->address,
+                          i, device == NULL || device->name == NULL ? "" : device->name,
+                          i, device == NULL || device->icon == NULL ? "" : device->icon);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to exit dict entry of adapter property\n");
             return ret;
         }
     }
 
-    ret = sd_bus_message_exit_container(reply);
-    if (ret < 0)
+    return append_text(output, "%s", config->warm_start ? STALE_TAG_FALSE : "\n");
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Signals usually come in bursts, so the tags are not printed right away. They are printed by
+// the main loop once all pending messages have been processed and the settle delay elapsed.
+static void mark_bluetooth_state_dirty(monitoring_context *context)
+{
+    if (!context->dirty)
     {
-        fprintf(stderr, "Failed to exit properties array of adapter\n");
-        return ret;
+        context->dirty = true;
+        context->dirty_since = now_usec();
     }
-
-    return 0;
 }
 
-static int parse_device_properties(sd_bus_message *reply, device_info *output)
+// Whether enough is known to print the tags for the first time.
+static bool is_bluetooth_state_ready(const monitoring_context *context)
 {
-    int ret = 0;
+    // The block saved by the previous run is more useful than an empty one while BlueZ is starting,
+    // but BlueZ may also never start, e.g. if there is no adapter.
+    if (context->persisted_shown && !context->available && now_usec() < context->persisted_until)
+    {
+        return false;
+    }
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sv}");
-    if (ret < 0)
+    if (context->pending_matches > 0)
     {
-        fprintf(stderr, "Failed to enter properties array of device\n");
-        return ret;
+        return false;
     }
 
-    for (;;)
+    if (context->enumerated)
     {
-        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sv");
-        if (ret < 0)
-        {
-            fprintf(stderr, "Failed to enter dict entry of device properties\n");
-            return ret;
-        }
-        if (ret == 0)
-        {
-            break;
-        }
+        return true;
+    }
 
-        const char *property;
-        ret = sd_bus_message_read(reply, "s", &property);
+    // In targeted mode, the adapter and device are fetched directly, the enumeration done in the
+    // background only completes 'count' and doesn't need to delay the first frame.
+    return context->config->device_object_path != NULL && context->initial_requests == 0;
+}
+
+// Give a block to the output, returns the number of older blocks it superseded.
+static int submit_block(monitoring_context *context, const text_buffer *block)
+{
+    // If the reader is slow, the block may still be queued when the next one is submitted, in
+    // which case it's dropped: there is no point in writing a state which is already outdated.
+    if (context->config->daemon)
+    {
+        return publish_block(&context->server, block->data, block->length);
+    }
+
+    return submit_output(&context->output, block->data, block->length);
+}
+
+// Write the tags to stdout, unless they are identical to the last block that was submitted.
+static int print_bluetooth_state(monitoring_context *context)
+{
+    int ret = 0;
+
+    if (context->config->max_devices > 0)
+    {
+        ret = update_device_order(&context->device_order, &context->cache, context->config->adapter_object_path);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to read device property name\n");
+            fprintf(stderr, "Failed to update device order\n");
             return ret;
         }
+    }
 
-        if (str_eq(property, "Connected"))
-        {
-            ret = read_boolean_variant(reply, &output->connected);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Connected' property\n");
-                return ret;
-            }
-        }
-        else if (str_eq(property, "Name"))
-        {
-            ret = read_string_variant(reply, &output->name);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Name' property\n");
-                return ret;
-            }
-        }
-        else if (str_eq(property, "Icon"))
-        {
-            ret = read_string_variant(reply, &output->icon);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Icon' property\n");
-                return ret;
-            }
-        }
-        else if (str_eq(property, "Address"))
-        {
-            ret = read_string_variant(reply, &output->address);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Address' property\n");
-                return ret;
-            }
-        }
-        else if (str_eq(property, "Adapter"))
-        {
-            ret = read_object_path_variant(reply, &output->adapter);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read value of 'Adapter' property\n");
-                return ret;
-            }
-        }
-        else
-        {
-            ret = sd_bus_message_skip(reply, "v");
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to skip variant\n");
-                return ret;
-            }
-        }
+    bluetooth_state state;
+    collect_bluetooth_state(context, &state);
 
-        ret = sd_bus_message_exit_container(reply);
-        if (ret < 0)
+    // Nearby devices are only updated when the tags are printed, since the hysteresis is only
+    // meant to keep them from flickering on the bar.
+    if (context->config->nearby)
+    {
+        context->rssi_dirty = false;
+        context->rssi_printed_at = now_usec();
+
+        if (state.adapter.discovering)
         {
-            fprintf(stderr, "Failed to exit dict entry of adapter property\n");
-            return ret;
+            state.nearby_count = (int)update_nearby_devices(&context->cache, context->config->adapter_object_path,
+                                                            context->config->nearby_threshold, &state.strongest_rssi);
         }
     }
 
-    ret = sd_bus_message_exit_container(reply);
+    ret = format_bluetooth_state(&state, context->config, &context->rendered);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to exit properties array of adapter\n");
+        fprintf(stderr, "Failed to format bluetooth state\n");
         return ret;
     }
 
-    return 0;
-}
+    const text_buffer *rendered = &context->rendered;
+    const text_buffer *emitted = &context->emitted;
 
-static bool is_desired_device(const monitoring_config *config, const device_info *device)
-{
-    if (device->adapter == NULL || !str_eq(device->adapter, config->adapter_object_path))
+    if (emitted->data != NULL && rendered->length == emitted->length && memcmp(rendered->data, emitted->data, rendered->length) == 0)
     {
-        return false;
+        context->stats.blocks_skipped++;
+        return 0;
+    }
+
+    ret = submit_block(context, rendered);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to write bluetooth state\n");
+        return ret;
+    }
+    context->stats.blocks_superseded += ret;
+
+    context->stats.blocks_emitted++;
+    context->stats.bytes_emitted += rendered->length;
+    TRACE1(emit, rendered->length);
+    record_histogram(&context->stats.emit_latency, now_usec() - context->dirty_since);
+
+    if (context->config->snapshot)
+    {
+        write_bluetooth_snapshot(&context->snapshot, state.available, state.adapter.powered, state.adapter.discovering,
+                                 state.device.connected, (uint32_t)state.connected_count, state.device.address,
+                                 state.device.name, state.device.icon, now_usec());
     }
 
-    if (config->device_mac_address != NULL)
+    // The block is saved later, so that a burst of changes only writes the file once.
+    if (context->persisting && !context->persist_pending)
     {
-        return device->address != NULL && str_eq_i(device->address, config->device_mac_address);
+        context->persist_pending = true;
+        context->persist_at = now_usec() + PERSIST_DELAY_US;
     }
 
-    return device->connected;
+    text_buffer swap = context->emitted;
+    context->emitted = context->rendered;
+    context->rendered = swap;
+    context->persisted_shown = false;
+
+    return 0;
 }
 
-static int fetch_bluetooth_state(sd_bus *bus, const monitoring_config *config)
+// Save the last block given to the output for the next run.
+static void save_bluetooth_state(monitoring_context *context)
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *reply = NULL;
+    context->persist_pending = false;
+
+    // Saving the block is a convenience, failing to do so doesn't stop the monitoring.
+    int ret = save_persisted_block(context->config->warm_start_path, context->emitted.data, context->emitted.length);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to save bluetooth state to %s: %s\n", context->config->warm_start_path, strerror(-ret));
+        context->persisting = false;
+    }
+}
 
+// Print the block saved by the previous run right away, marked as stale, so that the bar doesn't
+// stay empty until BlueZ replies. It's replaced as soon as the actual state is known.
+static int print_persisted_bluetooth_state(monitoring_context *context)
+{
     int ret = 0;
 
-    bool has_found_adapter = false;
-    adapter_info found_adapter;
-    init_adapter_info(&found_adapter);
+    text_buffer *block = &context->emitted;
 
-    bool has_found_device = false;
-    device_info found_device;
-    init_device_info(&found_device);
+    ret = load_persisted_block(context->config->warm_start_path, block);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to load bluetooth state from %s: %s\n", context->config->warm_start_path, strerror(-ret));
+        return 0;
+    }
 
-    int connected_count = 0;
+    // Ignore anything which isn't a block written by this version, e.g. a partial or foreign file.
+    size_t suffix_length = strlen(STALE_TAG_FALSE);
+    if (block->length < suffix_length || memcmp(block->data + block->length - suffix_length, STALE_TAG_FALSE, suffix_length) != 0)
+    {
+        block->length = 0;
+        return 0;
+    }
 
-    ret = sd_bus_call_method(bus, "org.bluez", "/",
-                             "org.freedesktop.DBus.ObjectManager",
-                             "GetManagedObjects", &error, &reply, NULL);
+    block->length -= suffix_length;
+    ret = append_text(block, "%s", STALE_TAG_TRUE);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to call 'ObjectManager' method\n");
-        goto finish;
+        return ret;
     }
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{oa{sa{sv}}}");
+    ret = submit_block(context, block);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to enter objects array\n");
-        goto finish;
+        fprintf(stderr, "Failed to write bluetooth state\n");
+        return ret;
     }
+    context->persisted_shown = true;
+    context->persisted_until = now_usec() + PERSISTED_SHOWN_MAX_US;
 
-    for (;;)
+    return 0;
+}
+
+static int fetch_bluetooth_state(sd_bus *bus, monitoring_context *context);
+
+// Replace the whole content of the cache by the enumeration of the BlueZ objects.
+static int on_managed_objects_received(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    monitoring_context *context = userdata;
+    sd_bus *bus = sd_bus_message_get_bus(reply);
+
+    int ret = 0;
+
+    context->fetch_pending = false;
+    record_histogram(&context->stats.fetch_duration, now_usec() - context->fetch_started_at);
+
+    if (sd_bus_message_is_method_error(reply, NULL))
     {
-        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "oa{sa{sv}}");
-        if (ret < 0)
+        // The call was sent to a BlueZ which stopped meanwhile, whatever the error, the new one is
+        // simply asked again.
+        if (context->fetch_again)
         {
-            fprintf(stderr, "Failed to object dict entry\n");
             goto finish;
         }
-        if (ret == 0)
+
+        // BlueZ stopped before replying, the owner change may not be known yet. It's asked again:
+        // if it's really gone, the next call fails with 'ServiceUnknown'.
+        const sd_bus_error *error = sd_bus_message_get_error(reply);
+        if (sd_bus_error_has_name(error, SD_BUS_ERROR_NO_REPLY))
         {
-            break;
+            context->fetch_again = true;
+            goto finish;
         }
 
-        const char *path;
-        ret = sd_bus_message_read(reply, "o", &path);
-        if (ret < 0)
+        // BlueZ is not started yet, the enumeration is done again once it takes its name.
+        if (sd_bus_error_has_name(error, SD_BUS_ERROR_SERVICE_UNKNOWN) || sd_bus_error_has_name(error, SD_BUS_ERROR_NAME_HAS_NO_OWNER))
         {
-            fprintf(stderr, "Failed to read object path\n");
+            clear_bluetooth_cache(&context->cache);
+            context->available = false;
+            context->enumerated = true;
+            mark_bluetooth_state_dirty(context);
             goto finish;
         }
 
-        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sa{sv}}");
+        fprintf(stderr, "Failed to call 'ObjectManager' method: %s\n", error->message);
+        ret = -sd_bus_message_get_errno(reply);
+        goto finish;
+    }
+
+    TRACE(parse_start);
+    clear_bluetooth_cache(&context->cache);
+
+    ret = parse_managed_objects(reply, context->config->namespaces, context->config->namespaces_count, &context->cache);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to parse managed objects\n");
+        goto finish;
+    }
+    TRACE1(parse_end, ret);
+    TRACE1(fetch_end, ret);
+    record_histogram(&context->stats.fetch_objects, (uint64_t)ret);
+
+    context->available = true;
+    context->enumerated = true;
+    mark_bluetooth_state_dirty(context);
+
+finish:
+    // Something changed while the call was pending, the reply may already be outdated. After a
+    // fatal error, the connection is dropped and everything is fetched again anyway.
+    if (ret >= 0 && context->fetch_again)
+    {
+        ret = fetch_bluetooth_state(bus, context);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to enter interfaces array\n");
-            goto finish;
+            fprintf(stderr, "Failed to fetch bluetooth state again\n");
         }
+    }
 
-        for (;;)
-        {
-            ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}");
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to enter interface dict entry\n");
-                goto finish;
-            }
-            if (ret == 0)
-            {
-                break;
-            }
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+        context->error = ret;
+    }
 
-            const char *interface;
-            ret = sd_bus_message_read(reply, "s", &interface);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to read interface name\n");
-                goto finish;
-            }
+    return ret;
+}
+
+// Ask for a full enumeration of the BlueZ objects without waiting for the reply. Only one call is
+// pending at a time: if another one is requested meanwhile, it's sent once the reply arrives.
+static int fetch_bluetooth_state(sd_bus *bus, monitoring_context *context)
+{
+    int ret = 0;
+
+    if (context->fetch_pending)
+    {
+        context->fetch_again = true;
+        return 0;
+    }
+
+    ret = sd_bus_call_method_async(bus, NULL, "org.bluez", "/",
+                                   "org.freedesktop.DBus.ObjectManager",
+                                   "GetManagedObjects", on_managed_objects_received, context, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to call 'ObjectManager' method\n");
+        return ret;
+    }
+
+    context->fetch_pending = true;
+    context->fetch_again = false;
+    context->fetch_started_at = now_usec();
+    TRACE(fetch_start);
+    context->stats.managed_objects_fetches++;
+
+    return 0;
+}
+
+
+// Read the 'as' list of invalidated properties and tell whether one of the 'wanted' ones is among them.
+// 'RSSI' is not fetched again: BlueZ invalidates it once the device is out of range, which is told
+// with 'rssi_lost' instead, unless it's NULL.
+static int read_invalidated_properties(sd_bus_message *reply, bool (*is_wanted)(const char *), bool *output, bool *rssi_lost)
+{
+    int ret = 0;
+
+    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "s");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to enter invalidated properties array\n");
+        return ret;
+    }
+
+    for (;;)
+    {
+        const char *property;
+        ret = sd_bus_message_read(reply, "s", &property);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to read invalidated property name\n");
+            return ret;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+
+        if (rssi_lost != NULL && str_eq(property, "RSSI"))
+        {
+            *rssi_lost = true;
+        }
+        else if (is_wanted(property))
+        {
+            *output = true;
+        }
+    }
+
+    ret = sd_bus_message_exit_container(reply);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to exit invalidated properties array\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+static void remove_properties_request(monitoring_context *context, properties_request *request)
+{
+    properties_request **link = &context->properties_requests;
+    while (*link != request)
+    {
+        link = &(*link)->next;
+    }
+    *link = request->next;
+
+    sd_bus_slot_unref(request->slot);
+    free(request->path);
+    free(request);
+}
+
+static void clear_properties_requests(monitoring_context *context)
+{
+    while (context->properties_requests != NULL)
+    {
+        remove_properties_request(context, context->properties_requests);
+    }
+}
+
+static int send_properties_request(sd_bus *bus, properties_request *request);
+
+static int on_object_properties_received(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    properties_request *request = userdata;
+    monitoring_context *context = request->context;
+    sd_bus *bus = sd_bus_message_get_bus(reply);
+
+    int ret = 0;
+
+    if (sd_bus_message_is_method_error(reply, NULL))
+    {
+        // The object doesn't exist (anymore), its removal is handled by 'InterfacesRemoved'.
+        goto finish;
+    }
+
+    context->available = true;
+
+    if (str_eq(request->interface, "org.bluez.Adapter1"))
+    {
+        adapter_info changes;
+        init_adapter_info(&changes);
+        ret = parse_adapter_properties(reply, &changes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to parse adapter properties\n");
+            goto finish;
+        }
+
+        ret = update_cached_adapter(&context->cache, request->path, &changes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to update cached adapter\n");
+            goto finish;
+        }
+        mark_bluetooth_state_dirty(context);
+    }
+    else if (str_eq(request->interface, "org.bluez.Battery1"))
+    {
+        battery_info changes;
+        init_battery_info(&changes);
+        ret = parse_battery_properties(reply, &changes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to parse battery properties\n");
+            goto finish;
+        }
+
+        ret = update_cached_battery(&context->cache, request->path, &changes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to update cached battery\n");
+            goto finish;
+        }
+        mark_bluetooth_state_dirty(context);
+    }
+    else
+    {
+        device_info changes;
+        init_device_info(&changes);
+        ret = parse_device_properties(reply, &changes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to parse device properties\n");
+            goto finish;
+        }
+
+        ret = update_cached_device(&context->cache, request->path, &changes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to update cached device\n");
+            goto finish;
+        }
+        mark_bluetooth_state_dirty(context);
+    }
+
+finish:
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
+
+    if (request->initial)
+    {
+        request->initial = false;
+        context->initial_requests--;
+    }
+
+    if (request->again)
+    {
+        ret = send_properties_request(bus, request);
+        if (ret >= 0)
+        {
+            return 0;
+        }
+        fprintf(stderr, "Failed to fetch object properties again\n");
+    }
+
+    remove_properties_request(context, request);
+
+    return ret;
+}
+
+static int send_properties_request(sd_bus *bus, properties_request *request)
+{
+    int ret = 0;
+
+    // The slot of the previous call, if any, is the one whose reply is being handled.
+    request->slot = sd_bus_slot_unref(request->slot);
+
+    ret = sd_bus_call_method_async(bus, &request->slot, "org.bluez", request->path,
+                                   "org.freedesktop.DBus.Properties",
+                                   "GetAll", on_object_properties_received, request, "s", request->interface);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to call 'Properties' method\n");
+        return ret;
+    }
+
+    request->again = false;
+    request->context->stats.properties_fetches++;
+    return 0;
+}
+
+// Refresh all the properties of one interface of an object. Several invalidations of the same
+// object are merged into a single call, since 'GetAll' returns all of them at once anyway.
+static int fetch_object_properties(sd_bus *bus, monitoring_context *context, const char *path, const char *interface, bool initial)
+{
+    int ret = 0;
+
+    for (properties_request *request = context->properties_requests; request != NULL; request = request->next)
+    {
+        if (str_eq(request->path, path) && str_eq(request->interface, interface))
+        {
+            request->again = true;
+            return 0;
+        }
+    }
+
+    properties_request *request = malloc(sizeof(properties_request));
+    char *path_copy = strdup(path);
+    if (request == NULL || path_copy == NULL)
+    {
+        fprintf(stderr, "Failed to allocate properties request\n");
+        free(request);
+        free(path_copy);
+        return -ENOMEM;
+    }
+
+    request->context = context;
+    request->path = path_copy;
+    request->interface = interface;
+    request->slot = NULL;
+    request->initial = initial;
+
+    ret = send_properties_request(bus, request);
+    if (ret < 0)
+    {
+        free(request->path);
+        free(request);
+        return ret;
+    }
+
+    request->next = context->properties_requests;
+    context->properties_requests = request;
+
+    if (initial)
+    {
+        context->initial_requests++;
+    }
+
+    return 0;
+}
+
+static size_t find_relevant_device(const monitoring_context *context, const char *path)
+{
+    if (!is_observed_object(context->config, path))
+    {
+        return NO_DEVICE;
+    }
+
+    return find_cached_device(&context->cache, path);
+}
+
+static cached_adapter *find_relevant_adapter(const monitoring_context *context, const char *path)
+{
+    if (!is_observed_object(context->config, path))
+    {
+        return NULL;
+    }
+
+    return find_cached_adapter(&context->cache, path);
+}
+
+// Device properties whose invalidation is worth a 'GetAll' call, i.e. the ones shown by the tags.
+// A lost RSSI is simply forgotten, since BlueZ only invalidates it once the device isn't seen.
+static bool is_shown_device_property(const char *name)
+{
+    return str_eq(name, "Connected") || str_eq(name, "Address") || str_eq(name, "Name") || str_eq(name, "Icon");
+}
+
+static int on_device_properties_changed(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    monitoring_context *context = userdata;
+    sd_bus *bus = sd_bus_message_get_bus(reply);
+    const char *path = sd_bus_message_get_path(reply);
+
+    int ret = 0;
+
+    context->stats.signals_received++;
+    TRACE1(device_properties_changed, path);
+
+    // Signals of unknown objects are dropped before looking at their body. New objects are
+    // announced with 'InterfacesAdded' and the initial enumeration is done after the matches
+    // are installed, so we can't miss any relevant object this way.
+    size_t device = find_cached_device(&context->cache, path);
+    if (device == NO_DEVICE)
+    {
+        context->stats.signals_dropped++;
+        goto finish;
+    }
+
+    const char *interface;
+    ret = sd_bus_message_read(reply, "s", &interface);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read interface name\n");
+        goto finish;
+    }
+
+    if (!str_eq(interface, "org.bluez.Device1"))
+    {
+        goto finish;
+    }
+
+    device_info changes;
+    init_device_info(&changes);
+    ret = parse_device_properties(reply, &changes);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to parse changed device properties\n");
+        goto finish;
+    }
+
+    bool invalidated = false;
+    bool rssi_lost = false;
+    ret = read_invalidated_properties(reply, is_shown_device_property, &invalidated, &rssi_lost);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read invalidated device properties\n");
+        goto finish;
+    }
+
+    // Devices of the other adapters are only counted. BlueZ always sends 'Connected' with its value,
+    // so their invalidated properties are never worth a call.
+    if (!is_observed_object(context->config, path))
+    {
+        changes.fields &= DEVICE_CONNECTED;
+        invalidated = false;
+        rssi_lost = false;
+    }
+
+    // During a discovery, most signals only carry an RSSI, which is useless without '--nearby'.
+    if (!context->config->nearby)
+    {
+        changes.fields &= ~DEVICE_RSSI;
+        rssi_lost = false;
+    }
+
+    if (changes.fields == 0 && !invalidated && !rssi_lost)
+    {
+        goto finish;
+    }
+
+    ret = update_cached_device_at(&context->cache, device, &changes);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to update cached device\n");
+        goto finish;
+    }
+
+    if (rssi_lost)
+    {
+        forget_cached_device_rssi(&context->cache, device);
+    }
+
+    if (invalidated)
+    {
+        ret = fetch_object_properties(bus, context, path, "org.bluez.Device1", false);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to fetch invalidated device properties\n");
+            goto finish;
+        }
+    }
+
+    // A discovery brings a flood of RSSI changes, they are printed by the main loop at a limited rate.
+    if (changes.fields == DEVICE_RSSI && !invalidated && !rssi_lost)
+    {
+        context->stats.rssi_updates++;
+        if (!context->rssi_dirty)
+        {
+            context->rssi_dirty = true;
+            context->rssi_dirty_since = now_usec();
+        }
+        goto finish;
+    }
+
+    mark_bluetooth_state_dirty(context);
+
+finish:
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
+
+    return ret;
+}
+
+// With '--battery-delta', small changes are not stored, so that the level printed only moves by
+// steps. Reaching empty or full is always shown.
+static bool is_battery_change_wanted(const monitoring_context *context, size_t device, uint8_t percentage)
+{
+    int previous = get_cached_battery(&context->cache, device);
+    if (previous < 0 || percentage == 0 || percentage == 100)
+    {
+        return true;
+    }
+
+    int delta = percentage > previous ? percentage - previous : previous - percentage;
+    return (unsigned int)delta >= context->config->battery_delta;
+}
+
+// Battery levels are not polled, they are only updated from the signals of 'org.bluez.Battery1'.
+static int on_battery_properties_changed(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    monitoring_context *context = userdata;
+    sd_bus *bus = sd_bus_message_get_bus(reply);
+    const char *path = sd_bus_message_get_path(reply);
+
+    int ret = 0;
+
+    context->stats.signals_received++;
+
+    size_t device = find_relevant_device(context, path);
+    if (device == NO_DEVICE)
+    {
+        context->stats.signals_dropped++;
+        goto finish;
+    }
+
+    const char *interface;
+    ret = sd_bus_message_read(reply, "s", &interface);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read interface name\n");
+        goto finish;
+    }
+
+    if (!str_eq(interface, "org.bluez.Battery1"))
+    {
+        goto finish;
+    }
+
+    battery_info changes;
+    init_battery_info(&changes);
+    ret = parse_battery_properties(reply, &changes);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to parse changed battery properties\n");
+        goto finish;
+    }
+
+    bool invalidated = false;
+    ret = read_invalidated_properties(reply, is_battery_property, &invalidated, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read invalidated battery properties\n");
+        goto finish;
+    }
+
+    if ((changes.fields & BATTERY_PERCENTAGE) && !is_battery_change_wanted(context, device, changes.percentage))
+    {
+        changes.fields &= ~BATTERY_PERCENTAGE;
+    }
+
+    if (changes.fields == 0 && !invalidated)
+    {
+        goto finish;
+    }
+
+    update_cached_battery_at(&context->cache, device, &changes);
+
+    if (invalidated)
+    {
+        ret = fetch_object_properties(bus, context, path, "org.bluez.Battery1", false);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to fetch invalidated battery properties\n");
+            goto finish;
+        }
+    }
+
+    mark_bluetooth_state_dirty(context);
+
+finish:
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
+
+    return ret;
+}
+
+static int on_adapter_properties_changed(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    monitoring_context *context = userdata;
+    sd_bus *bus = sd_bus_message_get_bus(reply);
+    const char *path = sd_bus_message_get_path(reply);
+
+    int ret = 0;
+
+    context->stats.signals_received++;
+    TRACE1(adapter_properties_changed, path);
+
+    // Same as for devices, signals of unknown adapters are dropped before looking at their body.
+    cached_adapter *adapter = find_relevant_adapter(context, path);
+    if (adapter == NULL)
+    {
+        context->stats.signals_dropped++;
+        goto finish;
+    }
+
+    const char *interface;
+    ret = sd_bus_message_read(reply, "s", &interface);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read interface name\n");
+        goto finish;
+    }
+
+    if (!str_eq(interface, "org.bluez.Adapter1"))
+    {
+        goto finish;
+    }
+
+    adapter_info changes;
+    init_adapter_info(&changes);
+    ret = parse_adapter_properties(reply, &changes);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to parse changed adapter properties\n");
+        goto finish;
+    }
+
+    bool invalidated = false;
+    ret = read_invalidated_properties(reply, is_adapter_property, &invalidated, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read invalidated adapter properties\n");
+        goto finish;
+    }
+
+    if (changes.fields == 0 && !invalidated)
+    {
+        goto finish;
+    }
+
+    update_adapter_info(&adapter->info, &changes);
+
+    if (invalidated)
+    {
+        ret = fetch_object_properties(bus, context, path, "org.bluez.Adapter1", false);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to fetch invalidated adapter properties\n");
+            goto finish;
+        }
+    }
+
+    mark_bluetooth_state_dirty(context);
+
+finish:
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
+
+    return ret;
+}
+
+static int on_interfaces_added(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    monitoring_context *context = userdata;
+
+    int ret = 0;
+
+    context->stats.signals_received++;
+
+    const char *path;
+    ret = sd_bus_message_read(reply, "o", &path);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read added object path\n");
+        goto finish;
+    }
+
+    ret = parse_object_interfaces(reply, path, is_observed_object(context->config, path), &context->cache);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to parse added interfaces\n");
+        goto finish;
+    }
+
+    mark_bluetooth_state_dirty(context);
+
+finish:
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
 
-            if (!has_found_adapter && str_eq(interface, "org.bluez.Adapter1") && str_eq(path, config->adapter_object_path))
-            {
-                adapter_info adapter;
-                init_adapter_info(&adapter);
-                ret = parse_adapter_properties(reply, &adapter);
-                if (ret < 0)
-                {
-                    fprintf(stderr, "Failed to parse adapter properties\n");
-                    goto finish;
-                }
-                found_adapter = adapter;
-                has_found_adapter = true;
-            }
-            else if (str_eq(interface, "org.bluez.Device1"))
-            {
-                device_info device;
-                init_device_info(&device);
-                ret = parse_device_properties(reply, &device);
-                if (ret < 0)
-                {
-                    fprintf(stderr, "Failed to parse device properties\n");
-                    goto finish;
-                }
+    return ret;
+}
 
-                if (!has_found_device && is_desired_device(config, &device))
-                {
-                    found_device = device;
-                    has_found_device = true;
-                }
-                if (device.connected)
-                {
-                    connected_count++;
-                }
-            }
-            else
-            {
-                ret = sd_bus_message_skip(reply, "a{sv}");
-                if (ret < 0)
-                {
-                    fprintf(stderr, "Failed to skip interface entry\n");
-                    goto finish;
-                }
-            }
+static int on_interfaces_removed(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
 
-            ret = sd_bus_message_exit_container(reply);
-            if (ret < 0)
-            {
-                fprintf(stderr, "Failed to exit interface entry\n");
-                goto finish;
-            }
-        }
+    monitoring_context *context = userdata;
+
+    int ret = 0;
+
+    context->stats.signals_received++;
+
+    const char *path;
+    ret = sd_bus_message_read(reply, "o", &path);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read removed object path\n");
+        goto finish;
+    }
+
+    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "s");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to enter removed interfaces array\n");
+        goto finish;
+    }
 
-        ret = sd_bus_message_exit_container(reply);
+    bool removed = false;
+
+    for (;;)
+    {
+        const char *interface;
+        ret = sd_bus_message_read(reply, "s", &interface);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to exit interfaces array\n");
+            fprintf(stderr, "Failed to read removed interface name\n");
             goto finish;
         }
+        if (ret == 0)
+        {
+            break;
+        }
 
-        ret = sd_bus_message_exit_container(reply);
-        if (ret < 0)
+        if (str_eq(interface, "org.bluez.Adapter1"))
         {
-            fprintf(stderr, "Failed to exit object dict entry\n");
-            goto finish;
+            removed |= remove_cached_adapter(&context->cache, path);
+        }
+        else if (str_eq(interface, "org.bluez.Device1"))
+        {
+            removed |= remove_cached_device(&context->cache, path);
+        }
+        else if (str_eq(interface, "org.bluez.Battery1"))
+        {
+            removed |= remove_cached_battery(&context->cache, path);
         }
     }
 
     ret = sd_bus_message_exit_container(reply);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to exit objects array\n");
+        fprintf(stderr, "Failed to exit removed interfaces array\n");
         goto finish;
     }
 
-    fprintf(stdout, "powered|bool|%s\n", found_adapter.powered ? "true" : "false");
-    fprintf(stdout, "discovering|bool|%s\n", found_adapter.discovering ? "true" : "false");
-    fprintf(stdout, "connected|bool|%s\n", found_device.connected ? "true" : "false");
-    fprintf(stdout, "count|int|%d\n", connected_count);
-    fprintf(stdout, "address|string|%s\n", found_device.address == NULL ? "" : found_device.address);
-    fprintf(stdout, "name|string|%s\n", found_device.name == NULL ? "" : found_device.name);
-    fprintf(stdout, "icon|string|%s\n", found_device.icon == NULL ? "" : found_device.icon);
-    fprintf(stdout, "\n");
-    fflush(stdout);
+    if (removed)
+    {
+        mark_bluetooth_state_dirty(context);
+    }
 
 finish:
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(reply);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
 
     return ret;
 }
 
-static int on_device_properties_changed(sd_bus_message *reply, void *config, sd_bus_error *ret_error)
+// Fetch everything from scratch, when the connection is opened and when BlueZ is restarted.
+static int synchronize_bluetooth_state(sd_bus *bus, monitoring_context *context)
+{
+    int ret = 0;
+
+    const monitoring_config *config = context->config;
+
+    // When a device is given, its properties and the ones of the adapter are fetched first, in
+    // parallel, so that the first frame doesn't depend on the number of devices known by BlueZ.
+    if (config->device_object_path != NULL)
+    {
+        ret = fetch_object_properties(bus, context, config->adapter_object_path, "org.bluez.Adapter1", true);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to fetch adapter properties\n");
+            return ret;
+        }
+
+        ret = fetch_object_properties(bus, context, config->device_object_path, "org.bluez.Device1", true);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to fetch device properties\n");
+            return ret;
+        }
+
+        // The call fails if the device doesn't report its battery, which is then left unknown.
+        ret = fetch_object_properties(bus, context, config->device_object_path, "org.bluez.Battery1", true);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to fetch battery properties\n");
+            return ret;
+        }
+    }
+
+    ret = fetch_bluetooth_state(bus, context);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to fetch bluetooth state\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// BlueZ is restarted on upgrades. Its objects disappear with it, and are all fetched again as soon
+// as it's back: the signals it sent meanwhile can't be trusted to describe the whole state.
+static int on_bluez_owner_changed(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
 {
     (void)ret_error;
 
+    monitoring_context *context = userdata;
     sd_bus *bus = sd_bus_message_get_bus(reply);
 
     int ret = 0;
 
-    const char *interface;
-    ret = sd_bus_message_read(reply, "s", &interface);
+    context->stats.signals_received++;
+
+    const char *name;
+    const char *old_owner;
+    const char *new_owner;
+    ret = sd_bus_message_read(reply, "sss", &name, &old_owner, &new_owner);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to read interface name\n");
+        fprintf(stderr, "Failed to read name owners\n");
         goto finish;
     }
 
-    if (!str_eq(interface, "org.bluez.Device1"))
+    // The replies of the previous owner, if they ever come, would be mixed with the new state.
+    clear_properties_requests(context);
+    context->initial_requests = 0;
+
+    clear_bluetooth_cache(&context->cache);
+    context->available = false;
+    mark_bluetooth_state_dirty(context);
+
+    if (new_owner[0] == '\0')
     {
+        // Nothing else to wait for, the tags tell that Bluetooth is unavailable.
+        context->enumerated = true;
         goto finish;
     }
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sv}");
+    context->enumerated = false;
+    context->stats.bluez_restarts++;
+
+    ret = synchronize_bluetooth_state(bus, context);
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to enter properties changed array\n");
+        fprintf(stderr, "Failed to synchronize bluetooth state\n");
         goto finish;
     }
 
-    bool refresh = false;
+finish:
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+    }
+
+    return ret;
+}
+
+typedef struct
+{
+    const char *description;
+    const char *format; // Match rule in which '%s' is replaced by an observed namespace, if scoped.
+    bool scoped;        // Whether the rule is installed once per observed namespace.
+    bool device_scoped; // Whether the namespace is the observed device instead, when it's given.
+    sd_bus_message_handler_t callback;
+} match_rule;
+
+// The rules are scoped to the observed adapters, so that the bus daemon doesn't even send us the
+// signals of other adapters or of the interfaces we are not interested in. Note that 'argNpath' is
+// used for 'ObjectManager' signals because plain 'argN' only applies to string arguments. Adapters
+// are matched by namespace, so that the same rules work when all of them are observed. Battery
+// levels only matter for the observed device, whose path is used when it's known.
+//
+// The devices are not scoped: 'count' includes the devices of every adapter, and a rule can't
+// select the 'Connected' changes alone since the changed properties are not an argument it can
+// match. The RSSI sent during a discovery on another adapter are therefore received, and dropped
+// by 'on_device_properties_changed()' without changing the cache. For the same reason, there is no
+// rule on the path of the observed device with '--device-address'.
+static const match_rule match_rules[] = {
+    {"adapter properties changed",
+     "type='signal',sender='org.bluez',path_namespace='%s',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',arg0='org.bluez.Adapter1'",
+     true, false, on_adapter_properties_changed},
+    {"device properties changed",
+     "type='signal',sender='org.bluez',path_namespace='/org/bluez',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',arg0='org.bluez.Device1'",
+     false, false, on_device_properties_changed},
+    {"battery properties changed",
+     "type='signal',sender='org.bluez',path_namespace='%s',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',arg0='org.bluez.Battery1'",
+     true, true, on_battery_properties_changed},
+    {"interfaces added",
+     "type='signal',sender='org.bluez',path='/',interface='org.freedesktop.DBus.ObjectManager',member='InterfacesAdded',arg0path='/org/bluez/'",
+     false, false, on_interfaces_added},
+    {"interfaces removed",
+     "type='signal',sender='org.bluez',path='/',interface='org.freedesktop.DBus.ObjectManager',member='InterfacesRemoved',arg0path='/org/bluez/'",
+     false, false, on_interfaces_removed},
+    {"bluez owner changed",
+     "type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.bluez'",
+     false, false, on_bluez_owner_changed},
+};
+
+static int on_match_rule_installed(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
+{
+    (void)ret_error;
+
+    monitoring_context *context = userdata;
+
+    context->pending_matches--;
+
+    if (sd_bus_message_is_method_error(reply, NULL))
+    {
+        fprintf(stderr, "Failed to install match rule: %s\n", sd_bus_message_get_error(reply)->message);
+        context->error = -sd_bus_message_get_errno(reply);
+        return context->error;
+    }
+
+    return 0;
+}
+
+// The rules are installed asynchronously: the bus daemon handles our messages in order, so they
+// are active before the initial fetch sent right after is processed, without waiting for them.
+static int add_match_rules(sd_bus *bus, monitoring_context *context)
+{
+    int ret = 0;
+
+    text_buffer rule;
+    init_text_buffer(&rule);
+
+    const monitoring_config *config = context->config;
+
+    for (size_t i = 0; i < sizeof(match_rules) / sizeof(match_rules[0]); i++)
+    {
+        bool device_scoped = match_rules[i].device_scoped && config->device_object_path != NULL;
+        size_t scopes = match_rules[i].scoped && !device_scoped ? config->namespaces_count : 1;
+
+        for (size_t j = 0; j < scopes; j++)
+        {
+            rule.length = 0;
+            ret = append_text(&rule, match_rules[i].format, device_scoped ? config->device_object_path : config->namespaces[j]);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to format match rule\n");
+                goto finish;
+            }
+
+            ret = sd_bus_add_match_async(bus, NULL, rule.data, match_rules[i].callback, on_match_rule_installed, context);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to add match for %s\n", match_rules[i].description);
+                goto finish;
+            }
+
+            context->pending_matches++;
+        }
+    }
+
+finish:
+    free_text_buffer(&rule);
+
+    return ret;
+}
+
+// Signals handled by the main loop.
+enum
+{
+    RECEIVED_STATS = 1 << 0,     // 'SIGUSR1', the statistics are dumped.
+    RECEIVED_TERMINATE = 1 << 1, // 'SIGTERM' or 'SIGINT', the monitoring stops and cleans up.
+};
+
+// The signals are blocked and read from a file descriptor, so that they are handled by the main
+// loop like the bus events, without any race.
+static int open_signal_fd(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+    {
+        fprintf(stderr, "Failed to block signals\n");
+        return -errno;
+    }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create signal file descriptor\n");
+        return -errno;
+    }
+
+    return fd;
+}
+
+// Read all the pending signals, and add the corresponding 'RECEIVED_*' flags to the output.
+static int read_signal_fd(int fd, unsigned int *output)
+{
+    struct signalfd_siginfo info;
 
     for (;;)
     {
-        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sv");
-        if (ret < 0)
+        ssize_t size = read(fd, &info, sizeof(info));
+        if (size < 0)
         {
-            fprintf(stderr, "Failed to enter dict entry of device properties changed\n");
-            goto finish;
+            if (errno == EAGAIN)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Failed to read signal file descriptor\n");
+            return -errno;
         }
-        if (ret == 0)
+
+        *output |= info.ssi_signo == SIGUSR1 ? RECEIVED_STATS : RECEIVED_TERMINATE;
+    }
+}
+
+// Same as 'sd_bus_wait()', but also wakes up when a signal is received, and writes the pending
+// output whenever stdout or the clients become writable. The deadline is a monotonic time in
+// microseconds, it's shortened if the bus has a timeout of its own. The bus is NULL while the
+// connection is waiting to be opened again.
+static int wait_for_events(sd_bus *bus, int signal_fd, monitoring_context *context, uint64_t deadline, unsigned int *signals)
+{
+    output_sink *output = &context->output;
+    block_server *server = &context->server;
+    bool daemon = context->config->daemon;
+    int ret = 0;
+
+    int bus_fd = -1;
+    int events = 0;
+
+    if (bus != NULL)
+    {
+        bus_fd = sd_bus_get_fd(bus);
+        if (bus_fd < 0)
         {
-            break;
+            fprintf(stderr, "Failed to get bus file descriptor\n");
+            return bus_fd;
         }
 
-        const char *property;
-        ret = sd_bus_message_read(reply, "s", &property);
+        events = sd_bus_get_events(bus);
+        if (events < 0)
+        {
+            fprintf(stderr, "Failed to get bus events\n");
+            return events;
+        }
+
+        uint64_t bus_deadline = UINT64_MAX;
+        ret = sd_bus_get_timeout(bus, &bus_deadline);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to read device property name\n");
-            goto finish;
+            fprintf(stderr, "Failed to get bus timeout\n");
+            return ret;
+        }
+        if (bus_deadline < deadline)
+        {
+            deadline = bus_deadline;
+        }
+    }
+
+    int timeout = -1;
+    if (deadline != UINT64_MAX)
+    {
+        uint64_t now = now_usec();
+        uint64_t remaining = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        timeout = remaining > INT_MAX ? INT_MAX : (int)remaining;
+    }
+
+    size_t count = 3 + (daemon ? count_server_poll_fds(server) : 0);
+    if (count > context->poll_fds_capacity)
+    {
+        struct pollfd *poll_fds = realloc(context->poll_fds, count * sizeof(struct pollfd));
+        if (poll_fds == NULL)
+        {
+            fprintf(stderr, "Failed to allocate poll descriptors\n");
+            return -ENOMEM;
         }
+        context->poll_fds = poll_fds;
+        context->poll_fds_capacity = count;
+    }
+
+    // Negative descriptors are ignored by 'poll()', stdout is only watched when it's needed.
+    struct pollfd *fds = context->poll_fds;
+    fds[0] = (struct pollfd){.fd = bus_fd, .events = (short)events};
+    fds[1] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+    fds[2] = (struct pollfd){.fd = !daemon && is_output_pending(output) ? output->fd : -1, .events = POLLOUT};
+    if (daemon)
+    {
+        fill_server_poll_fds(server, fds + 3);
+    }
 
-        if (str_eq(property, "Connected"))
+    ret = poll(fds, count, timeout);
+    if (ret < 0)
+    {
+        if (errno == EINTR)
         {
-            refresh = true;
+            return 0;
         }
+        fprintf(stderr, "Failed to poll file descriptors\n");
+        return -errno;
+    }
 
-        ret = sd_bus_message_skip(reply, "v");
+    if (fds[2].revents != 0)
+    {
+        ret = flush_output(output);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to skip variant\n");
-            goto finish;
+            fprintf(stderr, "Failed to flush output\n");
+            return ret;
         }
+    }
 
-        ret = sd_bus_message_exit_container(reply);
+    if (daemon)
+    {
+        ret = process_server_poll_fds(server, fds + 3, &context->emitted);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to exit dict entry of device property\n");
-            goto finish;
+            fprintf(stderr, "Failed to process clients\n");
+            return ret;
         }
     }
-
-    ret = sd_bus_message_exit_container(reply);
+
+    if (fds[1].revents & POLLIN)
+    {
+        return read_signal_fd(signal_fd, signals);
+    }
+
+    return 0;
+}
+
+// Delays between the attempts to connect to the bus, doubled after each failure.
+#define RECONNECT_MIN_DELAY_US 500000
+#define RECONNECT_MAX_DELAY_US 30000000
+
+// Connect to the system bus and start fetching the state, the replies are handled by the main loop.
+static int open_bluetooth_session(sd_bus **output, monitoring_context *context)
+{
+    int ret = 0;
+
+    ret = sd_bus_open_system(output);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to connect to the system bus\n");
+        return ret;
+    }
+
+    ret = add_match_rules(*output, context);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to add match rules\n");
+        return ret;
+    }
+
+    ret = synchronize_bluetooth_state(*output, context);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to synchronize bluetooth state\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// Drop the connection after an error, and everything learnt through it. The tags tell that
+// Bluetooth is unavailable until the connection is opened again, after a growing delay.
+static void close_bluetooth_session(sd_bus **bus, monitoring_context *context, int error)
+{
+    fprintf(stderr, "Error (%d): %s\n", error, strerror(-error));
+    fprintf(stderr, "Connecting to the system bus again in %" PRIu64 " ms\n", context->reconnect_delay / 1000);
+
+    // Pending calls are dropped with the bus, without their callbacks being called.
+    if (*bus != NULL)
+    {
+        sd_bus_close(*bus);
+        *bus = sd_bus_unref(*bus);
+    }
+    clear_properties_requests(context);
+    clear_bluetooth_cache(&context->cache);
+
+    context->fetch_pending = false;
+    context->fetch_again = false;
+    context->error = 0;
+    context->initial_requests = 0;
+    context->pending_matches = 0;
+    context->available = false;
+    context->enumerated = true;
+    mark_bluetooth_state_dirty(context);
+
+    context->reconnect_at = now_usec() + context->reconnect_delay;
+    context->reconnect_delay *= 2;
+    if (context->reconnect_delay > RECONNECT_MAX_DELAY_US)
+    {
+        context->reconnect_delay = RECONNECT_MAX_DELAY_US;
+    }
+    context->stats.reconnections++;
+}
+
+static int run_bluetooth_monitoring(const monitoring_config *config)
+{
+    sd_bus *bus = NULL;
+    int signal_fd = -1;
+    int ret = 0;
+
+    monitoring_context context;
+    context.config = config;
+    init_bluetooth_cache(&context.cache);
+    init_device_order(&context.device_order);
+    init_text_buffer(&context.rendered);
+    init_text_buffer(&context.emitted);
+    context.dirty = false;
+    context.dirty_since = 0;
+    context.rssi_dirty = false;
+    context.rssi_dirty_since = 0;
+    context.rssi_printed_at = 0;
+    context.fetch_pending = false;
+    context.fetch_again = false;
+    context.error = 0;
+    context.properties_requests = NULL;
+    context.enumerated = false;
+    context.initial_requests = 0;
+    context.pending_matches = 0;
+    context.fetch_started_at = 0;
+    init_monitoring_stats(&context.stats, now_usec());
+
+    context.poll_fds = NULL;
+    context.poll_fds_capacity = 0;
+    context.snapshot.mapped = NULL;
+    context.persisting = config->warm_start;
+    context.persisted_shown = false;
+    context.persisted_until = 0;
+    context.persist_pending = false;
+    context.persist_at = 0;
+    context.available = false;
+    context.reconnect_at = 0;
+    context.reconnect_delay = RECONNECT_MIN_DELAY_US;
+
+    // Bus messages must keep being processed while yambar doesn't read its input.
+    if (config->daemon)
+    {
+        // Clients may disconnect at any time, which must not kill the daemon.
+        signal(SIGPIPE, SIG_IGN);
+        ret = open_block_server(&context.server, config->socket_path);
+    }
+    else
+    {
+        ret = open_output_sink(&context.output, STDOUT_FILENO);
+    }
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to exit properties changed array\n");
+        fprintf(stderr, "Failed to set up output\n");
         goto finish;
     }
 
-    if (refresh)
+    if (config->snapshot)
     {
-        ret = fetch_bluetooth_state(bus, (monitoring_config *)config);
+        ret = open_snapshot_writer(&context.snapshot, config->snapshot_path);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to fetch bluetooth state\n");
+            fprintf(stderr, "Failed to set up snapshot\n");
             goto finish;
         }
     }
 
-finish:
-    if (ret < 0)
+    if (config->warm_start)
     {
-        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+        ret = print_persisted_bluetooth_state(&context);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to print persisted bluetooth state\n");
+            goto finish;
+        }
     }
 
-    return ret;
-}
-
-static int on_adapter_properties_changed(sd_bus_message *reply, void *config, sd_bus_error *ret_error)
-{
-    (void)ret_error;
-
-    sd_bus *bus = sd_bus_message_get_bus(reply);
-
-    int ret = 0;
+    uint64_t next_stats_at = context.stats.started_at + (uint64_t)config->stats_interval * 1000000;
 
-    const char *interface;
-    ret = sd_bus_message_read(reply, "s", &interface);
+    ret = open_signal_fd();
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to read interface name\n");
+        fprintf(stderr, "Failed to set up signal handling\n");
         goto finish;
     }
+    signal_fd = ret;
 
-    if (!str_eq(interface, "org.bluez.Adapter1"))
+    while (true)
     {
-        goto finish;
-    }
+        // Errors of the bus or of BlueZ are not fatal, unlike the ones of the output: the
+        // connection is opened again later and the state fetched from scratch.
+        if (bus == NULL && now_usec() >= context.reconnect_at)
+        {
+            ret = open_bluetooth_session(&bus, &context);
+            if (ret < 0)
+            {
+                close_bluetooth_session(&bus, &context, ret);
+                continue;
+            }
+        }
 
-    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sv}");
-    if (ret < 0)
-    {
-        fprintf(stderr, "Failed to enter properties changed array\n");
-        goto finish;
-    }
+        if (bus != NULL)
+        {
+            ret = sd_bus_process(bus, NULL);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to process bus\n");
+                close_bluetooth_session(&bus, &context, ret);
+                continue;
+            }
+            if (context.error < 0)
+            {
+                fprintf(stderr, "Failed to handle bus message\n");
+                close_bluetooth_session(&bus, &context, context.error);
+                continue;
+            }
+            if (ret > 0)
+            {
+                continue;
+            }
+
+            // The connection works, the next failure is unrelated to the previous ones.
+            if (context.available)
+            {
+                context.reconnect_delay = RECONNECT_MIN_DELAY_US;
+            }
+        }
 
-    bool refresh = false;
+        uint64_t now = now_usec();
+        uint64_t deadline = bus == NULL ? context.reconnect_at : UINT64_MAX;
 
-    for (;;)
-    {
-        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sv");
-        if (ret < 0)
+        if (context.rssi_dirty)
         {
-            fprintf(stderr, "Failed to enter dict entry of device properties changed\n");
-            goto finish;
+            uint64_t print_at = context.rssi_printed_at + (uint64_t)config->rssi_interval_ms * 1000;
+            if (now >= print_at)
+            {
+                context.rssi_dirty = false;
+                mark_bluetooth_state_dirty(&context);
+
+                // The latency of the block is counted from the change which made it necessary.
+                if (context.rssi_dirty_since < context.dirty_since)
+                {
+                    context.dirty_since = context.rssi_dirty_since;
+                }
+            }
+            else if (print_at < deadline)
+            {
+                deadline = print_at;
+            }
         }
-        if (ret == 0)
+
+        // Wake up to replace the block saved by the previous run if BlueZ still doesn't answer.
+        if (context.dirty && context.persisted_shown && !context.available && now < context.persisted_until &&
+            context.persisted_until < deadline)
         {
-            break;
+            deadline = context.persisted_until;
         }
 
-        const char *property;
-        ret = sd_bus_message_read(reply, "s", &property);
-        if (ret < 0)
+        if (context.dirty && is_bluetooth_state_ready(&context))
         {
-            fprintf(stderr, "Failed to read device property name\n");
-            goto finish;
+            uint64_t print_at = context.dirty_since + (uint64_t)config->settle_ms * 1000;
+            if (print_at < deadline)
+            {
+                deadline = print_at;
+            }
+
+            if (now >= print_at)
+            {
+                context.dirty = false;
+                ret = print_bluetooth_state(&context);
+                if (ret < 0)
+                {
+                    fprintf(stderr, "Failed to print bluetooth state\n");
+                    goto finish;
+                }
+                continue;
+            }
+        }
+
+        if (context.persist_pending)
+        {
+            if (now >= context.persist_at)
+            {
+                save_bluetooth_state(&context);
+            }
+            else if (context.persist_at < deadline)
+            {
+                deadline = context.persist_at;
+            }
         }
 
-        if (str_eq(property, "Powered") || str_eq(property, "Discovering"))
+        if (config->stats_interval > 0)
         {
-            refresh = true;
+            if (now >= next_stats_at)
+            {
+                print_monitoring_stats(stderr, &context.stats, now);
+                next_stats_at = now + (uint64_t)config->stats_interval * 1000000;
+            }
+            if (next_stats_at < deadline)
+            {
+                deadline = next_stats_at;
+            }
         }
 
-        ret = sd_bus_message_skip(reply, "v");
+        unsigned int signals = 0;
+        ret = wait_for_events(bus, signal_fd, &context, deadline, &signals);
         if (ret < 0)
         {
-            fprintf(stderr, "Failed to skip variant\n");
+            fprintf(stderr, "Failed to wait for events\n");
             goto finish;
         }
 
-        ret = sd_bus_message_exit_container(reply);
-        if (ret < 0)
+        if (signals & RECEIVED_STATS)
+        {
+            print_monitoring_stats(stderr, &context.stats, now_usec());
+        }
+        if (signals & RECEIVED_TERMINATE)
         {
-            fprintf(stderr, "Failed to exit dict entry of device property\n");
             goto finish;
         }
     }
 
-    ret = sd_bus_message_exit_container(reply);
+finish:
     if (ret < 0)
     {
-        fprintf(stderr, "Failed to exit properties changed array\n");
-        goto finish;
+        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
     }
 
-    if (refresh)
+    if (context.persist_pending)
     {
-        ret = fetch_bluetooth_state(bus, (monitoring_config *)config);
-        if (ret < 0)
-        {
-            fprintf(stderr, "Failed to fetch bluetooth state\n");
-            goto finish;
-        }
+        save_bluetooth_state(&context);
     }
 
-finish:
-    if (ret < 0)
+    sd_bus_unref(bus);
+    if (signal_fd >= 0)
     {
-        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+        close(signal_fd);
+    }
+    clear_properties_requests(&context);
+    clear_bluetooth_cache(&context.cache);
+    clear_device_order(&context.device_order);
+    free_text_buffer(&context.rendered);
+    free_text_buffer(&context.emitted);
+    if (config->daemon)
+    {
+        close_block_server(&context.server);
     }
+    else
+    {
+        close_output_sink(&context.output);
+    }
+    close_snapshot_writer(&context.snapshot);
+    free(context.poll_fds);
 
     return ret;
 }
 
-static int run_bluetooth_monitoring(const monitoring_config *config)
+static void print_help(const char *program_name)
 {
-    sd_bus *bus = NULL;
-    int ret = 0;
+    printf("Usage: %s [options]\n", program_name);
+    printf("Options:\n");
+    printf("  -n, --adapter-name <name>      Set the Bluetooth adapter name to observe (by default it uses 'hci0'), can be repeated to observe several adapters\n");
+    printf("  -a, --all-adapters             Observe all the adapters, the first given one (or 'hci0') is still used for the unprefixed tags\n");
+    printf("  -d, --device-address <address> Set the mac address for a specific device to observe (by default it uses the first one connected)\n");
+    printf("  -s, --settle-ms <ms>           Wait for the given delay after a change before printing the tags (by default they are printed as soon as no more signals are pending)\n");
+    printf("  -m, --max-devices <count>      List up to the given number of connected devices with indexed tags, e.g. 'device0_name' (at most %d)\n", MAX_LISTED_DEVICES);
+    printf("  -S, --stats <seconds>          Print runtime statistics to stderr at the given interval (they are also printed on SIGUSR1)\n");
+    printf("      --daemon                   Publish the tags to the clients of a Unix socket instead of printing them\n");
+    printf("      --client                   Print the tags published by a daemon started with the same options\n");
+    printf("      --socket <path>            Set the socket of the daemon (by default it's derived from the observed adapter and device, in $XDG_RUNTIME_DIR)\n");
+    printf("      --snapshot[=<path>]        Also publish the state in a memory-mapped file, see 'yambar-bluetooth-state' (by default it's derived like the socket)\n");
+    printf("      --warm-start[=<path>]      Save the last tags and print them at startup, with 'stale' set, until the actual state is known (by default they are saved in $XDG_STATE_HOME)\n");
+    printf("      --nearby[=<dBm>]           Print the number of nearby devices and their strongest RSSI during discovery (by default, devices are nearby from %d dBm)\n", DEFAULT_NEARBY_THRESHOLD);
+    printf("      --rssi-interval <ms>       Set the minimum delay between two blocks printed because of RSSI changes (default: %d)\n", DEFAULT_RSSI_INTERVAL_MS);
+    printf("      --battery-delta <percent>  Only print a battery level once it changed by at least the given amount since the last one printed\n");
+    printf("  -h, --help                     Display this help message\n");
+}
 
-    ret = sd_bus_open_system(&bus);
-    if (ret < 0)
+static int parse_rssi_argument(const char *name, const char *value, int *output)
+{
+    char *end = NULL;
+
+    errno = 0;
+    long result = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || result < -127 || result > 20)
     {
-        fprintf(stderr, "Failed to connect to the system bus\n");
-        goto finish;
+        fprintf(stderr, "Invalid value for option --%s: %s (expected an RSSI in dBm, between -127 and 20)\n", name, value);
+        return -1;
     }
 
-    ret = fetch_bluetooth_state(bus, config);
-    if (ret < 0)
+    *output = (int)result;
+    return 0;
+}
+
+static int parse_unsigned_argument(const char *name, const char *value, unsigned int *output)
+{
+    char *end = NULL;
+
+    errno = 0;
+    unsigned long result = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-' || result > UINT32_MAX)
     {
-        fprintf(stderr, "Failed to fetch bluetooth state\n");
-        goto finish;
+        fprintf(stderr, "Invalid value for option --%s: %s\n", name, value);
+        return -1;
     }
 
-    ret = sd_bus_add_match(bus,
-                           NULL,
-                           "type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',arg0namespace='org.bluez.Device1'",
-                           on_device_properties_changed,
-                           (void *)config);
-    if (ret < 0)
+    *output = (unsigned int)result;
+    return 0;
+}
+
+// Instances observing different adapters or devices print different tags, so each configuration
+// has its own files, e.g. "$XDG_RUNTIME_DIR/yambar-bluetooth-hci0-dev_AA_BB_CC_DD_EE_FF.sock".
+// When several adapters are observed, their names are joined, e.g. "yambar-bluetooth-hci0+hci1.sock".
+static char *make_default_path(const monitoring_config *config, const char *directory, const char *extension)
+{
+    text_buffer path;
+    init_text_buffer(&path);
+
+    int ret = append_text(&path, "%s/yambar-bluetooth-", directory);
+    if (config->device_object_path != NULL)
     {
-        fprintf(stderr, "Failed to add match for device properties changed\n");
-        goto finish;
+        ret = ret < 0 ? ret : append_text(&path, "%s", get_adapter_name(config->device_object_path));
     }
-
-    ret = sd_bus_add_match(bus,
-                           NULL,
-                           "type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',arg0namespace='org.bluez.Adapter1'",
-                           on_adapter_properties_changed,
-                           (void *)config);
-    if (ret < 0)
+    else if (config->all_adapters)
     {
-        fprintf(stderr, "Failed to add match for adapter properties changed\n");
-        goto finish;
+        ret = ret < 0 ? ret : append_text(&path, "all");
     }
-
-    while (true)
+    else
     {
-        ret = sd_bus_process(bus, NULL);
-        if (ret < 0)
-        {
-            fprintf(stderr, "Failed to process bus\n");
-            goto finish;
-        }
-        if (ret > 0)
+        for (size_t i = 0; i < config->namespaces_count; i++)
         {
-            continue;
+            ret = ret < 0 ? ret : append_text(&path, "%s%s", i > 0 ? "+" : "", get_adapter_name(config->namespaces[i]));
         }
-        ret = sd_bus_wait(bus, UINT64_MAX);
-        if (ret < 0)
+    }
+    ret = ret < 0 ? ret : append_text(&path, ".%s", extension);
+    if (ret < 0)
+    {
+        free_text_buffer(&path);
+        return NULL;
+    }
+
+    for (char *c = path.data + strlen(directory) + 1; *c != '\0'; c++)
+    {
+        if (*c == '/')
         {
-            fprintf(stderr, "Failed to wait on bus\n");
-            goto finish;
+            *c = '-';
         }
     }
 
-finish:
-    if (ret < 0)
+    return path.data;
+}
+
+static char *make_default_runtime_path(const monitoring_config *config, const char *extension, const char *option)
+{
+    const char *directory = getenv("XDG_RUNTIME_DIR");
+    if (directory == NULL || directory[0] == '\0')
     {
-        fprintf(stderr, "Error (%d): %s\n", ret, strerror(-ret));
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set, the path must be given with --%s.\n", option);
+        return NULL;
     }
 
-    sd_bus_unref(bus);
-
-    return ret;
+    return make_default_path(config, directory, extension);
 }
 
-static void print_help(const char *program_name)
+// Unlike the runtime directory, the state directory is kept across sessions.
+static char *make_default_state_path(const monitoring_config *config, const char *extension, const char *option)
 {
-    printf("Usage: %s [options]\n", program_name);
-    printf("Options:\n");
-    printf("  -n, --adapter-name <name>      Set the Bluetooth adapter name to observe (by default it uses 'hci0')\n");
-    printf("  -d, --device-address <address> Set the mac address for a specific device to observe (by default it uses the first one connected)\n");
-    printf("  -h, --help                     Display this help message\n");
+    const char *directory = getenv("XDG_STATE_HOME");
+    if (directory != NULL && directory[0] != '\0')
+    {
+        return make_default_path(config, directory, extension);
+    }
+
+    const char *home = getenv("HOME");
+    if (home == NULL || home[0] == '\0')
+    {
+        fprintf(stderr, "Neither XDG_STATE_HOME nor HOME are set, the path must be given with --%s.\n", option);
+        return NULL;
+    }
+
+    text_buffer default_directory;
+    init_text_buffer(&default_directory);
+    if (append_text(&default_directory, "%s/.local/state", home) < 0)
+    {
+        free_text_buffer(&default_directory);
+        return NULL;
+    }
+
+    // The directory is standard but not always created, failing here is reported when saving.
+    mkdir(default_directory.data, 0700);
+
+    char *path = make_default_path(config, default_directory.data, extension);
+    free_text_buffer(&default_directory);
+    return path;
 }
 
 static int parse_command_line_arguments(int argc, char *argv[], monitoring_config *output)
 {
     int opt = 0;
-    char *adapter_name = NULL;
+    const char *adapter_names[MAX_ADAPTERS];
+    size_t adapter_names_count = 0;
     char *device_address = NULL;
 
     struct option long_options[] = {
         {"adapter-name", required_argument, NULL, 'n'},
+        {"all-adapters", no_argument, NULL, 'a'},
         {"device-address", required_argument, NULL, 'd'},
+        {"settle-ms", required_argument, NULL, 's'},
+        {"max-devices", required_argument, NULL, 'm'},
+        {"stats", required_argument, NULL, 'S'},
+        {"daemon", no_argument, NULL, 'D'},
+        {"client", no_argument, NULL, 'C'},
+        {"socket", required_argument, NULL, 'P'},
+        {"snapshot", optional_argument, NULL, 'M'},
+        {"warm-start", optional_argument, NULL, 'W'},
+        {"nearby", optional_argument, NULL, 'N'},
+        {"rssi-interval", required_argument, NULL, 'R'},
+        {"battery-delta", required_argument, NULL, 'B'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}};
 
-    while ((opt = getopt_long(argc, argv, "n:d:h", long_options, NULL)) != -1)
+    while ((opt = getopt_long(argc, argv, "n:ad:s:m:S:h", long_options, NULL)) != -1)
     {
         switch (opt)
         {
         case 'n':
-            adapter_name = optarg;
+            if (adapter_names_count == MAX_ADAPTERS)
+            {
+                fprintf(stderr, "Option --adapter-name can be given at most %d times.\n", MAX_ADAPTERS);
+                return -1;
+            }
+            adapter_names[adapter_names_count++] = optarg;
+            break;
+        case 'a':
+            output->all_adapters = true;
             break;
         case 'd':
             device_address = optarg;
             break;
+        case 's':
+            if (parse_unsigned_argument("settle-ms", optarg, &output->settle_ms) < 0)
+            {
+                return -1;
+            }
+            break;
+        case 'm':
+            if (parse_unsigned_argument("max-devices", optarg, &output->max_devices) < 0)
+            {
+                return -1;
+            }
+            if (output->max_devices > MAX_LISTED_DEVICES)
+            {
+                fprintf(stderr, "Invalid value for option --max-devices: at most %d devices can be listed\n", MAX_LISTED_DEVICES);
+                return -1;
+            }
+            break;
+        case 'S':
+            if (parse_unsigned_argument("stats", optarg, &output->stats_interval) < 0)
+            {
+                return -1;
+            }
+            break;
+        case 'D':
+            output->daemon = true;
+            break;
+        case 'C':
+            output->client = true;
+            break;
+        case 'P':
+            output->socket_path = optarg;
+            break;
+        case 'M':
+            output->snapshot = true;
+            output->snapshot_path = optarg;
+            break;
+        case 'W':
+            output->warm_start = true;
+            output->warm_start_path = optarg;
+            break;
+        case 'N':
+            output->nearby = true;
+            if (optarg != NULL && parse_rssi_argument("nearby", optarg, &output->nearby_threshold) < 0)
+            {
+                return -1;
+            }
+            break;
+        case 'R':
+            if (parse_unsigned_argument("rssi-interval", optarg, &output->rssi_interval_ms) < 0)
+            {
+                return -1;
+            }
+            break;
+        case 'B':
+            if (parse_unsigned_argument("battery-delta", optarg, &output->battery_delta) < 0)
+            {
+                return -1;
+            }
+            break;
         case 'h':
             print_help(argv[0]);
             return 1;
@@ -811,22 +2310,107 @@ static int parse_command_line_arguments(int argc, char *argv[], monitoring_confi
         }
     }
 
-    if (adapter_name != NULL)
+    if (adapter_names_count == 0)
+    {
+        adapter_names[adapter_names_count++] = "hci0";
+    }
+
+    // The first adapter is the main one, described by the unprefixed tags.
+    const char **adapter_paths = malloc(adapter_names_count * sizeof(char *));
+    for (size_t i = 0; i < adapter_names_count; i++)
+    {
+        char *result = malloc(strlen(BLUEZ_PATH_PREFIX) + strlen(adapter_names[i]) + 1);
+        strcpy(result, BLUEZ_PATH_PREFIX);
+        strcat(result, adapter_names[i]);
+        adapter_paths[i] = result;
+    }
+    output->adapter_object_path = adapter_paths[0];
+
+    if (output->all_adapters)
     {
-        const char *prefix = "/org/bluez/";
-        char *result = malloc(strlen(prefix) + strlen(adapter_name) + 1);
-        strcpy(result, prefix);
-        strcat(result, adapter_name);
-        output->adapter_object_path = result;
+        static const char *all_namespaces[] = {"/org/bluez"};
+        output->namespaces = all_namespaces;
+        output->namespaces_count = 1;
     }
     else
     {
-        output->adapter_object_path = "/org/bluez/hci0";
+        output->namespaces = adapter_paths;
+        output->namespaces_count = adapter_names_count;
     }
+    output->multiple_adapters = output->all_adapters || adapter_names_count > 1;
 
     if (device_address != NULL)
     {
-        output->device_mac_address = device_address;
+        if (!parse_mac_address(device_address, &output->device_address))
+        {
+            fprintf(stderr, "Invalid value for option --device-address: %s\n", device_address);
+            return -1;
+        }
+
+        // BlueZ names device objects after their address, e.g. "/org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF".
+        const char *infix = "/dev_";
+        char *result = malloc(strlen(output->adapter_object_path) + strlen(infix) + strlen(device_address) + 1);
+        strcpy(result, output->adapter_object_path);
+        strcat(result, infix);
+        char *suffix = result + strlen(result);
+        strcpy(suffix, device_address);
+        for (char *c = suffix; *c != '\0'; c++)
+        {
+            *c = *c == ':' ? '_' : toupper((unsigned char)*c);
+        }
+        output->has_device_address = true;
+        output->device_object_path = result;
+    }
+
+    if (output->daemon && output->client)
+    {
+        fprintf(stderr, "Options --daemon and --client are mutually exclusive.\n");
+        return -1;
+    }
+
+    if (output->client && output->snapshot)
+    {
+        fprintf(stderr, "Option --snapshot can't be used with --client, it must be given to the daemon.\n");
+        return -1;
+    }
+
+    if (output->client && output->warm_start)
+    {
+        fprintf(stderr, "Option --warm-start can't be used with --client, it must be given to the daemon.\n");
+        return -1;
+    }
+
+    if (output->client && output->nearby)
+    {
+        fprintf(stderr, "Option --nearby can't be used with --client, it must be given to the daemon.\n");
+        return -1;
+    }
+
+    if ((output->daemon || output->client) && output->socket_path == NULL)
+    {
+        output->socket_path = make_default_runtime_path(output, "sock", "socket");
+        if (output->socket_path == NULL)
+        {
+            return -1;
+        }
+    }
+
+    if (output->snapshot && output->snapshot_path == NULL)
+    {
+        output->snapshot_path = make_default_runtime_path(output, "state", "snapshot");
+        if (output->snapshot_path == NULL)
+        {
+            return -1;
+        }
+    }
+
+    if (output->warm_start && output->warm_start_path == NULL)
+    {
+        output->warm_start_path = make_default_state_path(output, "tags", "warm-start");
+        if (output->warm_start_path == NULL)
+        {
+            return -1;
+        }
     }
 
     return 0;
@@ -838,7 +2422,26 @@ int main(int argc, char *argv[])
 
     monitoring_config config;
     config.adapter_object_path = NULL;
-    config.device_mac_address = NULL;
+    config.namespaces = NULL;
+    config.namespaces_count = 0;
+    config.multiple_adapters = false;
+    config.all_adapters = false;
+    config.has_device_address = false;
+    config.device_object_path = NULL;
+    config.settle_ms = 0;
+    config.max_devices = 0;
+    config.nearby = false;
+    config.nearby_threshold = DEFAULT_NEARBY_THRESHOLD;
+    config.rssi_interval_ms = DEFAULT_RSSI_INTERVAL_MS;
+    config.battery_delta = 0;
+    config.stats_interval = 0;
+    config.daemon = false;
+    config.client = false;
+    config.socket_path = NULL;
+    config.snapshot = false;
+    config.snapshot_path = NULL;
+    config.warm_start = false;
+    config.warm_start_path = NULL;
     ret = parse_command_line_arguments(argc, argv, &config);
     if (ret > 0)
     {
@@ -850,6 +2453,17 @@ int main(int argc, char *argv[])
         return ret;
     }
 
+    if (config.client)
+    {
+        ret = run_block_client(config.socket_path);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to relay bluetooth state\n");
+            return ret;
+        }
+        return 0;
+    }
+
     ret = run_bluetooth_monitoring(&config);
     if (ret < 0)
     {
@@ -0,0 +1,183 @@
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void init_text_buffer(text_buffer *buffer)
+{
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+void free_text_buffer(text_buffer *buffer)
+{
+    free(buffer->data);
+    init_text_buffer(buffer);
+}
+
+int append_text(text_buffer *buffer, const char *format, ...)
+{
+    va_list args;
+
+    for (;;)
+    {
+        size_t available = buffer->capacity - buffer->length;
+
+        va_start(args, format);
+        int length = vsnprintf(buffer->data + buffer->length, available, format, args);
+        va_end(args);
+
+        if (length < 0)
+        {
+            fprintf(stderr, "Failed to format text\n");
+            return -EINVAL;
+        }
+        if ((size_t)length < available)
+        {
+            buffer->length += length;
+            return 0;
+        }
+
+        size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+        while (capacity - buffer->length <= (size_t)length)
+        {
+            capacity *= 2;
+        }
+
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Failed to allocate text buffer\n");
+            return -ENOMEM;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+}
+
+int reserve_text(text_buffer *buffer, size_t capacity)
+{
+    if (capacity <= buffer->capacity)
+    {
+        return 0;
+    }
+
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Failed to allocate text buffer\n");
+        return -ENOMEM;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int open_output_sink(output_sink *sink, int fd)
+{
+    sink->fd = fd;
+    sink->written = 0;
+    init_text_buffer(&sink->current);
+    init_text_buffer(&sink->next);
+
+    sink->flags = fcntl(fd, F_GETFL);
+    if (sink->flags < 0)
+    {
+        fprintf(stderr, "Failed to get file descriptor flags\n");
+        return -errno;
+    }
+
+    if (!(sink->flags & O_NONBLOCK) && fcntl(fd, F_SETFL, sink->flags | O_NONBLOCK) < 0)
+    {
+        fprintf(stderr, "Failed to make file descriptor non-blocking\n");
+        return -errno;
+    }
+
+    return 0;
+}
+
+// The flags belong to the open file description, which may be shared with other processes (e.g.
+// a terminal), so they must not be left non-blocking.
+void close_output_sink(output_sink *sink)
+{
+    if (sink->flags >= 0 && !(sink->flags & O_NONBLOCK))
+    {
+        fcntl(sink->fd, F_SETFL, sink->flags);
+    }
+
+    free_text_buffer(&sink->current);
+    free_text_buffer(&sink->next);
+}
+
+int submit_output(output_sink *sink, const char *data, size_t length)
+{
+    int ret = 0;
+
+    bool idle = !is_output_pending(sink);
+    bool superseded = !idle && sink->next.length > 0;
+    text_buffer *target = idle ? &sink->current : &sink->next;
+
+    ret = reserve_text(target, length);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    memcpy(target->data, data, length);
+    target->length = length;
+
+    ret = flush_output(sink);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    return superseded ? 1 : 0;
+}
+
+int flush_output(output_sink *sink)
+{
+    for (;;)
+    {
+        while (sink->written < sink->current.length)
+        {
+            ssize_t written = write(sink->fd, sink->current.data + sink->written, sink->current.length - sink->written);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return 0;
+                }
+                fprintf(stderr, "Failed to write output\n");
+                return -errno;
+            }
+            sink->written += written;
+        }
+
+        sink->current.length = 0;
+        sink->written = 0;
+
+        if (sink->next.length == 0)
+        {
+            return 0;
+        }
+
+        text_buffer swap = sink->current;
+        sink->current = sink->next;
+        sink->next = swap;
+    }
+}
+
+bool is_output_pending(const output_sink *sink)
+{
+    return sink->written < sink->current.length;
+}
@@ -0,0 +1,49 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} text_buffer;
+
+// Writes blocks of text to a non-blocking file descriptor, without ever waiting for the reader. A
+// block is always written entirely, but while it is, only the most recent of the following blocks
+// is kept: the older ones describe an outdated state and are dropped.
+typedef struct
+{
+    int fd;
+    int flags;           // Original flags of the file descriptor, restored when the sink is closed.
+    text_buffer current; // Block being written, empty if the sink is idle.
+    size_t written;      // Number of bytes of 'current' already written.
+    text_buffer next;    // Block to write once 'current' is done, empty if none.
+} output_sink;
+
+void init_text_buffer(text_buffer *buffer);
+
+void free_text_buffer(text_buffer *buffer);
+
+int append_text(text_buffer *buffer, const char *format, ...);
+
+// Make sure the buffer can hold at least 'capacity' bytes.
+int reserve_text(text_buffer *buffer, size_t capacity);
+
+int open_output_sink(output_sink *sink, int fd);
+
+void close_output_sink(output_sink *sink);
+
+// Queue a block and write as much of it as possible right away. Returns 1 if a block which was
+// still waiting to be written got dropped in favor of this one, 0 otherwise.
+int submit_output(output_sink *sink, const char *data, size_t length);
+
+// Continue writing the queued blocks, once the file descriptor is writable again.
+int flush_output(output_sink *sink);
+
+// Whether some bytes wait for the file descriptor to be writable.
+bool is_output_pending(const output_sink *sink);
+
+#endif
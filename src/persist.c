@@ -0,0 +1,125 @@
+#include "persist.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Blocks are a few hundred bytes, anything much larger isn't a file written by this tool.
+#define MAX_PERSISTED_SIZE 65536
+
+int load_persisted_block(const char *path, text_buffer *output)
+{
+    int ret = 0;
+
+    output->length = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    for (;;)
+    {
+        if (output->capacity - output->length < 1024)
+        {
+            ret = reserve_text(output, output->capacity == 0 ? 1024 : output->capacity * 2);
+            if (ret < 0)
+            {
+                goto finish;
+            }
+        }
+
+        ssize_t count = read(fd, output->data + output->length, output->capacity - output->length);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            ret = -errno;
+            goto finish;
+        }
+        if (count == 0)
+        {
+            break;
+        }
+
+        output->length += count;
+        if (output->length > MAX_PERSISTED_SIZE)
+        {
+            ret = -EFBIG;
+            goto finish;
+        }
+    }
+
+finish:
+    close(fd);
+    if (ret < 0)
+    {
+        output->length = 0;
+    }
+
+    return ret;
+}
+
+int save_persisted_block(const char *path, const char *data, size_t length)
+{
+    int ret = 0;
+
+    text_buffer temporary_path;
+    init_text_buffer(&temporary_path);
+
+    ret = append_text(&temporary_path, "%s.tmp", path);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    int fd = open(temporary_path.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        ret = -errno;
+        goto finish;
+    }
+
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t count = write(fd, data + written, length - written);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            ret = -errno;
+            close(fd);
+            goto finish;
+        }
+        written += count;
+    }
+
+    if (close(fd) < 0)
+    {
+        ret = -errno;
+        goto finish;
+    }
+
+    if (rename(temporary_path.data, path) < 0)
+    {
+        ret = -errno;
+        goto finish;
+    }
+
+finish:
+    if (ret < 0)
+    {
+        unlink(temporary_path.data);
+    }
+    free_text_buffer(&temporary_path);
+
+    return ret;
+}
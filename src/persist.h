@@ -0,0 +1,14 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stddef.h>
+
+#include "output.h"
+
+// Read the block saved by a previous run. The buffer is left empty if there is none.
+int load_persisted_block(const char *path, text_buffer *output);
+
+// Replace the saved block. The file is written aside and renamed, so that it's never truncated.
+int save_persisted_block(const char *path, const char *data, size_t length);
+
+#endif
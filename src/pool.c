@@ -0,0 +1,153 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t hash_string(const char *value)
+{
+    // FNV-1a. The pool holds object paths, names and icons: every byte changes the whole hash, so
+    // the paths, which share a long prefix, and the few distinct icons still spread over the slots.
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = value; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+void init_string_pool(string_pool *pool)
+{
+    pool->data = NULL;
+    pool->length = 0;
+    pool->capacity = 0;
+    pool->slots = NULL;
+    pool->slots_capacity = 0;
+    pool->count = 0;
+}
+
+void clear_string_pool(string_pool *pool)
+{
+    free(pool->data);
+    free(pool->slots);
+    init_string_pool(pool);
+}
+
+// Find the slot of the string, or the empty slot where it belongs.
+static size_t find_string_slot(const string_pool *pool, const char *value)
+{
+    size_t mask = pool->slots_capacity - 1;
+    size_t slot = hash_string(value) & mask;
+
+    while (pool->slots[slot] != NO_STRING && strcmp(pool->data + pool->slots[slot], value) != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static int grow_string_slots(string_pool *pool)
+{
+    // The table is kept at most half full, with a capacity which is a power of two.
+    size_t capacity = pool->slots_capacity == 0 ? 64 : pool->slots_capacity * 2;
+
+    string_ref *slots = malloc(capacity * sizeof(string_ref));
+    if (slots == NULL)
+    {
+        fprintf(stderr, "Failed to allocate string slots\n");
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        slots[i] = NO_STRING;
+    }
+
+    string_ref *previous = pool->slots;
+    size_t previous_capacity = pool->slots_capacity;
+
+    pool->slots = slots;
+    pool->slots_capacity = capacity;
+
+    for (size_t i = 0; i < previous_capacity; i++)
+    {
+        if (previous[i] != NO_STRING)
+        {
+            pool->slots[find_string_slot(pool, pool->data + previous[i])] = previous[i];
+        }
+    }
+
+    free(previous);
+    return 0;
+}
+
+int intern_string(string_pool *pool, const char *value, string_ref *output)
+{
+    int ret = 0;
+
+    if ((pool->count + 1) * 2 > pool->slots_capacity)
+    {
+        ret = grow_string_slots(pool);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    size_t slot = find_string_slot(pool, value);
+    if (pool->slots[slot] != NO_STRING)
+    {
+        *output = pool->slots[slot];
+        return 0;
+    }
+
+    size_t size = strlen(value) + 1;
+    if (pool->length + size >= NO_STRING)
+    {
+        fprintf(stderr, "Failed to intern string, the pool is full\n");
+        return -E2BIG;
+    }
+
+    if (pool->length + size > pool->capacity)
+    {
+        size_t capacity = pool->capacity == 0 ? 1024 : pool->capacity;
+        while (capacity < pool->length + size)
+        {
+            capacity *= 2;
+        }
+
+        char *data = realloc(pool->data, capacity);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Failed to allocate string pool\n");
+            return -ENOMEM;
+        }
+        pool->data = data;
+        pool->capacity = capacity;
+    }
+
+    memcpy(pool->data + pool->length, value, size);
+    pool->slots[slot] = (string_ref)pool->length;
+    pool->length += size;
+    pool->count++;
+
+    *output = pool->slots[slot];
+    return 0;
+}
+
+string_ref find_string(const string_pool *pool, const char *value)
+{
+    if (pool->count == 0)
+    {
+        return NO_STRING;
+    }
+
+    return pool->slots[find_string_slot(pool, value)];
+}
+
+const char *get_string(const string_pool *pool, string_ref ref)
+{
+    return ref == NO_STRING ? NULL : pool->data + ref;
+}
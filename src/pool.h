@@ -0,0 +1,37 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reference to a string of a pool, i.e. its offset in the pool buffer.
+typedef uint32_t string_ref;
+
+#define NO_STRING UINT32_MAX
+
+// Strings stored one after the other in a single buffer, each of them only once: interning the
+// same string twice gives the same reference, so interned strings are compared by reference.
+// Strings are never removed, the pool must be rebuilt to drop the ones not used anymore.
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    string_ref *slots; // Open-addressing table of the strings, 'NO_STRING' if the slot is empty.
+    size_t slots_capacity;
+    size_t count;
+} string_pool;
+
+void init_string_pool(string_pool *pool);
+
+void clear_string_pool(string_pool *pool);
+
+int intern_string(string_pool *pool, const char *value, string_ref *output);
+
+// Reference of a string already interned, or 'NO_STRING' if it's not in the pool.
+string_ref find_string(const string_pool *pool, const char *value);
+
+// The string of a reference, or NULL for 'NO_STRING'. Only valid until the next string is interned.
+const char *get_string(const string_pool *pool, string_ref ref);
+
+#endif
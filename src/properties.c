@@ -0,0 +1,310 @@
+#include "properties.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+
+void init_adapter_info(adapter_info *adapter)
+{
+    adapter->fields = 0;
+    adapter->powered = false;
+    adapter->discovering = false;
+}
+
+void init_device_info(device_info *device)
+{
+    device->fields = 0;
+    device->connected = false;
+    device->paired = false;
+    device->rssi = 0;
+    device->address = NULL;
+    device->name = NULL;
+    device->icon = NULL;
+    device->adapter = NULL;
+}
+
+void init_battery_info(battery_info *battery)
+{
+    battery->fields = 0;
+    battery->percentage = 0;
+}
+
+// Decoding of one property of a BlueZ interface into a field of 'adapter_info', 'device_info' or
+// 'battery_info'.
+typedef struct
+{
+    const char *name;
+    const char *signature; // Type of the variant. Only 'b', 'y', 'n', 's' and 'o' are supported.
+    size_t offset;         // Offset of the field in the info structure.
+    unsigned int flag;     // Flag set in the 'fields' of the info structure once the field is read.
+} property_decoder;
+
+// Number of slots of the lookup tables, must be a power of two larger than the number of decoders.
+#define PROPERTY_SLOTS 32
+
+typedef struct
+{
+    unsigned char length; // Length of the name of the decoder, to skip most comparisons.
+    unsigned char index;  // Index of the decoder plus one, or zero if the slot is empty.
+} property_slot;
+
+// The properties of an interface that are decoded, with an open-addressing table indexed by the
+// length and the first character of the property name. It's filled on first use.
+typedef struct
+{
+    const char *kind; // Kind of object, used in error messages.
+    const property_decoder *decoders;
+    size_t decoders_count;
+    size_t fields_offset; // Offset of the 'fields' member in the info structure.
+    bool indexed;
+    property_slot slots[PROPERTY_SLOTS];
+} property_schema;
+
+#define ADAPTER_PROPERTY(name, signature, field, flag) {name, signature, offsetof(adapter_info, field), flag}
+#define DEVICE_PROPERTY(name, signature, field, flag) {name, signature, offsetof(device_info, field), flag}
+#define BATTERY_PROPERTY(name, signature, field, flag) {name, signature, offsetof(battery_info, field), flag}
+
+static const property_decoder adapter_decoders[] = {
+    ADAPTER_PROPERTY("Powered", "b", powered, ADAPTER_POWERED),
+    ADAPTER_PROPERTY("Discovering", "b", discovering, ADAPTER_DISCOVERING),
+};
+
+static const property_decoder device_decoders[] = {
+    DEVICE_PROPERTY("Connected", "b", connected, DEVICE_CONNECTED),
+    DEVICE_PROPERTY("Paired", "b", paired, DEVICE_PAIRED),
+    DEVICE_PROPERTY("Address", "s", address, DEVICE_ADDRESS),
+    DEVICE_PROPERTY("Name", "s", name, DEVICE_NAME),
+    DEVICE_PROPERTY("Icon", "s", icon, DEVICE_ICON),
+    DEVICE_PROPERTY("Adapter", "o", adapter, DEVICE_ADAPTER),
+    DEVICE_PROPERTY("RSSI", "n", rssi, DEVICE_RSSI),
+};
+
+static const property_decoder battery_decoders[] = {
+    BATTERY_PROPERTY("Percentage", "y", percentage, BATTERY_PERCENTAGE),
+};
+
+static property_schema adapter_schema = {
+    .kind = "adapter",
+    .decoders = adapter_decoders,
+    .decoders_count = sizeof(adapter_decoders) / sizeof(adapter_decoders[0]),
+    .fields_offset = offsetof(adapter_info, fields),
+};
+
+static property_schema device_schema = {
+    .kind = "device",
+    .decoders = device_decoders,
+    .decoders_count = sizeof(device_decoders) / sizeof(device_decoders[0]),
+    .fields_offset = offsetof(device_info, fields),
+};
+
+static property_schema battery_schema = {
+    .kind = "battery",
+    .decoders = battery_decoders,
+    .decoders_count = sizeof(battery_decoders) / sizeof(battery_decoders[0]),
+    .fields_offset = offsetof(battery_info, fields),
+};
+
+static size_t hash_property_name(size_t length, const char *name)
+{
+    return (length * 31 + (unsigned char)name[0]) & (PROPERTY_SLOTS - 1);
+}
+
+static void index_property_schema(property_schema *schema)
+{
+    for (size_t i = 0; i < schema->decoders_count; i++)
+    {
+        const char *name = schema->decoders[i].name;
+        size_t length = strlen(name);
+        size_t slot = hash_property_name(length, name);
+
+        while (schema->slots[slot].index != 0)
+        {
+            slot = (slot + 1) & (PROPERTY_SLOTS - 1);
+        }
+
+        schema->slots[slot].length = (unsigned char)length;
+        schema->slots[slot].index = (unsigned char)(i + 1);
+    }
+
+    schema->indexed = true;
+}
+
+static const property_decoder *find_property_decoder(property_schema *schema, const char *name)
+{
+    if (!schema->indexed)
+    {
+        index_property_schema(schema);
+    }
+
+    size_t length = strlen(name);
+
+    // Names longer than any decoder can't match, and must not be truncated into a false match.
+    if (length > UCHAR_MAX)
+    {
+        return NULL;
+    }
+
+    for (size_t slot = hash_property_name(length, name); schema->slots[slot].index != 0; slot = (slot + 1) & (PROPERTY_SLOTS - 1))
+    {
+        const property_slot *entry = &schema->slots[slot];
+        const property_decoder *decoder = &schema->decoders[entry->index - 1];
+        if (entry->length == length && memcmp(decoder->name, name, length) == 0)
+        {
+            return decoder;
+        }
+    }
+
+    return NULL;
+}
+
+static int decode_property(sd_bus_message *reply, const property_decoder *decoder, char *output)
+{
+    int ret = 0;
+
+    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_VARIANT, decoder->signature);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to enter variant container of '%s' property\n", decoder->name);
+        return ret;
+    }
+
+    if (decoder->signature[0] == SD_BUS_TYPE_BOOLEAN)
+    {
+        int value; // Documentation requires 'int' and not 'bool'.
+        ret = sd_bus_message_read_basic(reply, SD_BUS_TYPE_BOOLEAN, &value);
+        if (ret >= 0)
+        {
+            *(bool *)(output + decoder->offset) = value;
+        }
+    }
+    else
+    {
+        ret = sd_bus_message_read_basic(reply, decoder->signature[0], output + decoder->offset);
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to read value of '%s' property\n", decoder->name);
+        return ret;
+    }
+
+    ret = sd_bus_message_exit_container(reply);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to exit variant container of '%s' property\n", decoder->name);
+        return ret;
+    }
+
+    return 0;
+}
+
+// Read an 'a{sv}' dictionary of properties. The ones described by the schema are stored in the
+// info structure, which keeps pointers to the strings of the message, the others are skipped.
+static int parse_properties(sd_bus_message *reply, property_schema *schema, void *output)
+{
+    unsigned int *fields = (unsigned int *)((char *)output + schema->fields_offset);
+    int ret = 0;
+
+    ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{sv}");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to enter properties array of %s\n", schema->kind);
+        return ret;
+    }
+
+    for (;;)
+    {
+        ret = sd_bus_message_enter_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sv");
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to enter dict entry of %s properties\n", schema->kind);
+            return ret;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+
+        const char *property;
+        ret = sd_bus_message_read_basic(reply, SD_BUS_TYPE_STRING, &property);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to read %s property name\n", schema->kind);
+            return ret;
+        }
+
+        const property_decoder *decoder = find_property_decoder(schema, property);
+        if (decoder != NULL)
+        {
+            ret = decode_property(reply, decoder, output);
+            if (ret < 0)
+            {
+                return ret;
+            }
+            *fields |= decoder->flag;
+        }
+        else
+        {
+            ret = sd_bus_message_skip(reply, "v");
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to skip %s property value\n", schema->kind);
+                return ret;
+            }
+        }
+
+        ret = sd_bus_message_exit_container(reply);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to exit dict entry of %s properties\n", schema->kind);
+            return ret;
+        }
+    }
+
+    ret = sd_bus_message_exit_container(reply);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to exit properties array of %s\n", schema->kind);
+        return ret;
+    }
+
+    return 0;
+}
+
+int parse_adapter_properties(sd_bus_message *reply, adapter_info *output)
+{
+    return parse_properties(reply, &adapter_schema, output);
+}
+
+int parse_device_properties(sd_bus_message *reply, device_info *output)
+{
+    return parse_properties(reply, &device_schema, output);
+}
+
+int parse_battery_properties(sd_bus_message *reply, battery_info *output)
+{
+    return parse_properties(reply, &battery_schema, output);
+}
+
+bool is_adapter_property(const char *name)
+{
+    return find_property_decoder(&adapter_schema, name) != NULL;
+}
+
+bool is_battery_property(const char *name)
+{
+    return find_property_decoder(&battery_schema, name) != NULL;
+}
+
+void update_adapter_info(adapter_info *target, const adapter_info *changes)
+{
+    if (changes->fields & ADAPTER_POWERED)
+    {
+        target->powered = changes->powered;
+    }
+    if (changes->fields & ADAPTER_DISCOVERING)
+    {
+        target->discovering = changes->discovering;
+    }
+
+    target->fields |= changes->fields;
+}
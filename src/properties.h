@@ -0,0 +1,82 @@
+#ifndef PROPERTIES_H
+#define PROPERTIES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#define str_eq(a, b) (strcmp((a), (b)) == 0)
+
+// Flags telling which properties were actually read into an 'adapter_info', a 'device_info' or a
+// 'battery_info'.
+enum
+{
+    ADAPTER_POWERED = 1 << 0,
+    ADAPTER_DISCOVERING = 1 << 1,
+};
+
+enum
+{
+    DEVICE_CONNECTED = 1 << 0,
+    DEVICE_ADDRESS = 1 << 1,
+    DEVICE_NAME = 1 << 2,
+    DEVICE_ICON = 1 << 3,
+    DEVICE_ADAPTER = 1 << 4,
+    DEVICE_PAIRED = 1 << 5,
+    DEVICE_RSSI = 1 << 6,
+};
+
+enum
+{
+    BATTERY_PERCENTAGE = 1 << 0,
+};
+
+typedef struct
+{
+    unsigned int fields; // Combination of 'ADAPTER_*' flags.
+    bool powered;
+    bool discovering;
+} adapter_info;
+
+typedef struct
+{
+    unsigned int fields; // Combination of 'DEVICE_*' flags.
+    bool connected;
+    bool paired;
+    int16_t rssi; // In dBm. Only sent by BlueZ while the device is seen during discovery.
+    const char *address;
+    const char *name;
+    const char *icon;
+    const char *adapter;
+} device_info;
+
+// Properties of the 'org.bluez.Battery1' interface, found on the objects of the devices which
+// report their battery level.
+typedef struct
+{
+    unsigned int fields; // Combination of 'BATTERY_*' flags.
+    uint8_t percentage;
+} battery_info;
+
+void init_adapter_info(adapter_info *adapter);
+
+void init_device_info(device_info *device);
+
+void init_battery_info(battery_info *battery);
+
+int parse_adapter_properties(sd_bus_message *reply, adapter_info *output);
+
+int parse_device_properties(sd_bus_message *reply, device_info *output);
+
+int parse_battery_properties(sd_bus_message *reply, battery_info *output);
+
+// Whether the property is one of those read by 'parse_adapter_properties()'.
+bool is_adapter_property(const char *name);
+
+// Whether the property is one of those read by 'parse_battery_properties()'.
+bool is_battery_property(const char *name);
+
+void update_adapter_info(adapter_info *target, const adapter_info *changes);
+
+#endif
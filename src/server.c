@@ -0,0 +1,290 @@
+// For accept4().
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int make_socket_address(const char *path, struct sockaddr_un *address)
+{
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+// A socket file is left behind when a daemon is killed. It's only removed if nobody listens on it.
+static int remove_stale_socket(const struct sockaddr_un *address)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create socket\n");
+        return -errno;
+    }
+
+    int ret = connect(fd, (const struct sockaddr *)address, sizeof(*address));
+    int error = errno;
+    close(fd);
+
+    if (ret == 0)
+    {
+        fprintf(stderr, "Another daemon is already listening on %s\n", address->sun_path);
+        return -EADDRINUSE;
+    }
+    if (error == ECONNREFUSED && unlink(address->sun_path) < 0 && errno != ENOENT)
+    {
+        fprintf(stderr, "Failed to remove stale socket %s\n", address->sun_path);
+        return -errno;
+    }
+
+    return 0;
+}
+
+int open_block_server(block_server *server, const char *path)
+{
+    struct sockaddr_un address;
+    int ret = 0;
+
+    server->fd = -1;
+    server->path = path;
+    server->clients = NULL;
+    server->clients_count = 0;
+    server->clients_capacity = 0;
+
+    ret = make_socket_address(path, &address);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = remove_stale_socket(&address);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd < 0)
+    {
+        fprintf(stderr, "Failed to create socket\n");
+        return -errno;
+    }
+
+    if (bind(server->fd, (const struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "Failed to bind socket to %s\n", path);
+        ret = -errno;
+        close(server->fd);
+        server->fd = -1;
+        return ret;
+    }
+
+    if (listen(server->fd, 16) < 0)
+    {
+        fprintf(stderr, "Failed to listen on socket\n");
+        ret = -errno;
+        close(server->fd);
+        server->fd = -1;
+        unlink(path);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void remove_block_client(block_server *server, size_t index)
+{
+    output_sink *client = &server->clients[index];
+    close_output_sink(client);
+    close(client->fd);
+
+    server->clients[index] = server->clients[server->clients_count - 1];
+    server->clients_count--;
+}
+
+void close_block_server(block_server *server)
+{
+    while (server->clients_count > 0)
+    {
+        remove_block_client(server, server->clients_count - 1);
+    }
+    free(server->clients);
+
+    if (server->fd >= 0)
+    {
+        close(server->fd);
+        unlink(server->path);
+    }
+}
+
+static int add_block_client(block_server *server, int fd, const text_buffer *latest)
+{
+    int ret = 0;
+
+    if (server->clients_count == server->clients_capacity)
+    {
+        size_t capacity = server->clients_capacity == 0 ? 4 : server->clients_capacity * 2;
+        output_sink *clients = realloc(server->clients, capacity * sizeof(output_sink));
+        if (clients == NULL)
+        {
+            fprintf(stderr, "Failed to allocate clients\n");
+            close(fd);
+            return -ENOMEM;
+        }
+        server->clients = clients;
+        server->clients_capacity = capacity;
+    }
+
+    output_sink *client = &server->clients[server->clients_count++];
+
+    ret = open_output_sink(client, fd);
+    if (ret >= 0 && latest->length > 0)
+    {
+        ret = submit_output(client, latest->data, latest->length);
+    }
+    if (ret < 0)
+    {
+        // The client is already gone, there is nothing wrong with the daemon itself.
+        fprintf(stderr, "Failed to set up client\n");
+        remove_block_client(server, server->clients_count - 1);
+    }
+
+    return 0;
+}
+
+int accept_block_clients(block_server *server, const text_buffer *latest)
+{
+    int ret = 0;
+
+    for (;;)
+    {
+        int fd = accept4(server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "Failed to accept client\n");
+            return -errno;
+        }
+
+        ret = add_block_client(server, fd, latest);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+int publish_block(block_server *server, const char *data, size_t length)
+{
+    int superseded = 0;
+
+    for (size_t i = server->clients_count; i-- > 0;)
+    {
+        int ret = submit_output(&server->clients[i], data, length);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to write to client, disconnecting it\n");
+            remove_block_client(server, i);
+            continue;
+        }
+        superseded += ret;
+    }
+
+    return superseded;
+}
+
+size_t count_server_poll_fds(const block_server *server)
+{
+    return 1 + server->clients_count;
+}
+
+// Clients never send anything, they are only watched to notice when they disconnect.
+void fill_server_poll_fds(const block_server *server, struct pollfd *fds)
+{
+    fds[0].fd = server->fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+    for (size_t i = 0; i < server->clients_count; i++)
+    {
+        const output_sink *client = &server->clients[i];
+        fds[i + 1].fd = client->fd;
+        fds[i + 1].events = POLLIN | (is_output_pending(client) ? POLLOUT : 0);
+        fds[i + 1].revents = 0;
+    }
+}
+
+static bool is_client_connected(const output_sink *client)
+{
+    char data[64];
+
+    for (;;)
+    {
+        ssize_t size = read(client->fd, data, sizeof(data));
+        if (size > 0)
+        {
+            continue;
+        }
+        return size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+}
+
+int process_server_poll_fds(block_server *server, const struct pollfd *fds, const text_buffer *latest)
+{
+    int ret = 0;
+
+    // A removed client is replaced by the last one, so they are processed from the last to the
+    // first one: a removal never moves a client whose events were not handled yet.
+    for (size_t i = server->clients_count; i-- > 0;)
+    {
+        short revents = fds[i + 1].revents;
+        output_sink *client = &server->clients[i];
+
+        if ((revents & (POLLIN | POLLHUP | POLLERR)) && !is_client_connected(client))
+        {
+            remove_block_client(server, i);
+            continue;
+        }
+
+        if (revents & POLLOUT)
+        {
+            ret = flush_output(client);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Failed to write to client, disconnecting it\n");
+                remove_block_client(server, i);
+            }
+        }
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+        ret = accept_block_clients(server, latest);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <poll.h>
+#include <stddef.h>
+
+#include "output.h"
+
+// Publishes the blocks of tags to the clients connected to a Unix socket, in daemon mode. Each
+// client has its own output sink, so a slow client only loses the blocks it didn't read in time.
+typedef struct
+{
+    int fd; // Listening socket.
+    const char *path;
+    output_sink *clients;
+    size_t clients_count;
+    size_t clients_capacity;
+} block_server;
+
+int open_block_server(block_server *server, const char *path);
+
+void close_block_server(block_server *server);
+
+// Accept the pending connections. The last published block is sent to new clients right away.
+int accept_block_clients(block_server *server, const text_buffer *latest);
+
+// Send a block to all the clients, and return the number of them which dropped an older block.
+int publish_block(block_server *server, const char *data, size_t length);
+
+// Number of descriptors added by 'fill_server_poll_fds()'.
+size_t count_server_poll_fds(const block_server *server);
+
+void fill_server_poll_fds(const block_server *server, struct pollfd *fds);
+
+// Handle the events reported by 'poll()' for the descriptors of 'fill_server_poll_fds()'.
+int process_server_poll_fds(block_server *server, const struct pollfd *fds, const text_buffer *latest);
+
+#endif
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+// Minimal reader of the file written by 'yambar-bluetooth --snapshot', mostly meant as an example
+// and for scripts: it prints the tags once, or the value of a single one.
+
+static void print_help(const char *program_name)
+{
+    printf("Usage: %s <path> [tag]\n", program_name);
+    printf("Print the state published by 'yambar-bluetooth --snapshot' in the given file, either all\n");
+    printf("the tags in the format of yambar, or only the value of the given tag.\n");
+}
+
+static int print_snapshot(const bluetooth_snapshot *snapshot, const char *tag)
+{
+    char count[16];
+    snprintf(count, sizeof(count), "%u", snapshot->count);
+
+    const struct
+    {
+        const char *name;
+        const char *type;
+        const char *value;
+    } tags[] = {
+        {"powered", "bool", snapshot->powered ? "true" : "false"},
+        {"discovering", "bool", snapshot->discovering ? "true" : "false"},
+        {"connected", "bool", snapshot->connected ? "true" : "false"},
+        {"count", "int", count},
+        {"address", "string", snapshot->address},
+        {"name", "string", snapshot->name},
+        {"icon", "string", snapshot->icon},
+        {"available", "bool", snapshot->available ? "true" : "false"},
+    };
+
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++)
+    {
+        if (tag == NULL)
+        {
+            printf("%s|%s|%s\n", tags[i].name, tags[i].type, tags[i].value);
+        }
+        else if (strcmp(tags[i].name, tag) == 0)
+        {
+            printf("%s\n", tags[i].value);
+            return 0;
+        }
+    }
+
+    if (tag != NULL)
+    {
+        fprintf(stderr, "Unknown tag: %s\n", tag);
+        return -EINVAL;
+    }
+
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+    {
+        print_help(argv[0]);
+        return argc < 2 || argc > 3 ? 1 : 0;
+    }
+
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open snapshot file %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) < 0 || (size_t)status.st_size < sizeof(bluetooth_snapshot))
+    {
+        fprintf(stderr, "Failed to read snapshot file, it's too short\n");
+        close(fd);
+        return 1;
+    }
+
+    void *mapped = mmap(NULL, sizeof(bluetooth_snapshot), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map snapshot file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    bluetooth_snapshot snapshot;
+    if (!read_bluetooth_snapshot(mapped, &snapshot))
+    {
+        fprintf(stderr, "Failed to read snapshot file, its layout is not supported or it's left in the middle of an update\n");
+        ret = 1;
+        goto finish;
+    }
+
+    // The file is removed when the writer exits, unless it was killed.
+    if (kill((pid_t)snapshot.pid, 0) < 0 && errno == ESRCH)
+    {
+        fprintf(stderr, "Warning: the writer (pid %u) is not running, the state is outdated\n", snapshot.pid);
+        ret = 2;
+    }
+
+    if (print_snapshot(&snapshot, argc == 3 ? argv[2] : NULL) < 0)
+    {
+        ret = 1;
+    }
+
+finish:
+    munmap(mapped, sizeof(bluetooth_snapshot));
+
+    return ret;
+}
@@ -0,0 +1,101 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int open_snapshot_writer(snapshot_writer *writer, const char *path)
+{
+    int ret = 0;
+
+    writer->path = path;
+    writer->mapped = NULL;
+
+    // The file is replaced rather than truncated, so that readers which still map an old file
+    // never see it shrink under them.
+    unlink(path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create snapshot file %s\n", path);
+        return -errno;
+    }
+
+    if (ftruncate(fd, sizeof(bluetooth_snapshot)) < 0)
+    {
+        fprintf(stderr, "Failed to resize snapshot file\n");
+        ret = -errno;
+        goto finish;
+    }
+
+    void *mapped = mmap(NULL, sizeof(bluetooth_snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map snapshot file\n");
+        ret = -errno;
+        goto finish;
+    }
+
+    // The file is created empty, so the sequence starts at zero. The header is written last, so
+    // that readers reject the file until it's complete.
+    writer->mapped = mapped;
+    writer->mapped->size = sizeof(bluetooth_snapshot);
+    writer->mapped->pid = (uint32_t)getpid();
+    writer->mapped->version = SNAPSHOT_VERSION;
+    atomic_thread_fence(memory_order_release);
+    writer->mapped->magic = SNAPSHOT_MAGIC;
+
+finish:
+    close(fd);
+    if (ret < 0)
+    {
+        unlink(path);
+    }
+
+    return ret;
+}
+
+void close_snapshot_writer(snapshot_writer *writer)
+{
+    if (writer->mapped != NULL)
+    {
+        munmap(writer->mapped, sizeof(bluetooth_snapshot));
+        unlink(writer->path);
+        writer->mapped = NULL;
+    }
+}
+
+static void copy_field(char *target, size_t size, const char *value)
+{
+    size_t length = value == NULL ? 0 : strnlen(value, size - 1);
+    memcpy(target, value == NULL ? "" : value, length);
+    memset(target + length, 0, size - length);
+}
+
+void write_bluetooth_snapshot(snapshot_writer *writer, bool available, bool powered, bool discovering,
+                              bool connected, uint32_t count, const char *address, const char *name,
+                              const char *icon, uint64_t now)
+{
+    bluetooth_snapshot *mapped = writer->mapped;
+    _Atomic uint64_t *sequence = (_Atomic uint64_t *)&mapped->sequence;
+
+    // Sequence lock: readers retry if the sequence is odd or changed while they were copying.
+    uint64_t current = atomic_load_explicit(sequence, memory_order_relaxed);
+    atomic_store_explicit(sequence, current + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    mapped->updated_at = now;
+    mapped->count = count;
+    mapped->powered = powered;
+    mapped->discovering = discovering;
+    mapped->connected = connected;
+    mapped->available = available;
+    copy_field(mapped->address, sizeof(mapped->address), address);
+    copy_field(mapped->name, sizeof(mapped->name), name);
+    copy_field(mapped->icon, sizeof(mapped->icon), icon);
+
+    atomic_store_explicit(sequence, current + 2, memory_order_release);
+}
@@ -0,0 +1,96 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// Binary layout of the state file written with '--snapshot'. The file can be mapped by any local
+// program to read the state without talking to D-Bus: include this header, map the file read-only
+// and call 'read_bluetooth_snapshot()'. See 'snapshot-reader.c' for an example.
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SNAPSHOT_MAGIC 0x53425942 // "BYBS" in little-endian.
+#define SNAPSHOT_VERSION 1
+
+// Sizes of the string fields, including the terminating null character. Longer strings are
+// truncated. BlueZ limits the names to 248 bytes.
+#define SNAPSHOT_ADDRESS_SIZE 18
+#define SNAPSHOT_NAME_SIZE 249
+#define SNAPSHOT_ICON_SIZE 64
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;     // Size of the whole structure, to detect incompatible layouts.
+    uint32_t pid;      // Process writing the file, which is removed when the process exits cleanly.
+    uint64_t sequence; // Odd while the fields below are being written.
+    uint64_t updated_at; // Monotonic time (CLOCK_MONOTONIC, in microseconds) of the last update.
+    uint32_t count;    // Number of connected devices.
+    uint8_t powered;
+    uint8_t discovering;
+    uint8_t connected;
+    uint8_t available; // Whether BlueZ is running and answering.
+    char address[SNAPSHOT_ADDRESS_SIZE];
+    char name[SNAPSHOT_NAME_SIZE];
+    char icon[SNAPSHOT_ICON_SIZE];
+} bluetooth_snapshot;
+
+// Number of attempts of 'read_bluetooth_snapshot()'. An update only takes a few microseconds, a
+// sequence still odd after that many attempts means the writer died in the middle of one.
+#define SNAPSHOT_READ_ATTEMPTS 1000
+
+// Copy a consistent state out of a mapped snapshot, retrying while the writer updates it. Returns
+// false if the mapping doesn't hold a snapshot with the expected layout, or if no consistent state
+// could be read.
+static inline bool read_bluetooth_snapshot(const bluetooth_snapshot *mapped, bluetooth_snapshot *output)
+{
+    if (mapped->magic != SNAPSHOT_MAGIC || mapped->version != SNAPSHOT_VERSION || mapped->size != sizeof(bluetooth_snapshot))
+    {
+        return false;
+    }
+
+    const _Atomic uint64_t *sequence = (const _Atomic uint64_t *)&mapped->sequence;
+
+    for (unsigned int attempt = 0; attempt < SNAPSHOT_READ_ATTEMPTS; attempt++)
+    {
+        uint64_t before = atomic_load_explicit(sequence, memory_order_acquire);
+        if (before & 1)
+        {
+            // Let the writer finish its update, it may be waiting for this CPU.
+            sched_yield();
+            continue;
+        }
+
+        memcpy(output, mapped, sizeof(bluetooth_snapshot));
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(sequence, memory_order_relaxed) == before)
+        {
+            output->sequence = before;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Writer side, used by yambar-bluetooth itself.
+typedef struct
+{
+    const char *path;
+    bluetooth_snapshot *mapped;
+} snapshot_writer;
+
+int open_snapshot_writer(snapshot_writer *writer, const char *path);
+
+void close_snapshot_writer(snapshot_writer *writer);
+
+// Replace the content of the snapshot. The strings can be NULL, in which case they are cleared.
+void write_bluetooth_snapshot(snapshot_writer *writer, bool available, bool powered, bool discovering,
+                              bool connected, uint32_t count, const char *address, const char *name,
+                              const char *icon, uint64_t now);
+
+#endif
@@ -0,0 +1,132 @@
+#include "stats.h"
+
+#include <inttypes.h>
+
+#define SUB_BUCKETS (1 << HISTOGRAM_PRECISION)
+
+static unsigned int find_bucket(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return (unsigned int)value;
+    }
+
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int shift = exponent - HISTOGRAM_PRECISION;
+    return ((shift + 1) << HISTOGRAM_PRECISION) + (unsigned int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper_bound(unsigned int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    unsigned int shift = (bucket >> HISTOGRAM_PRECISION) - 1;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void init_histogram(histogram *histogram)
+{
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        histogram->counts[i] = 0;
+    }
+    histogram->count = 0;
+    histogram->sum = 0;
+    histogram->min = UINT64_MAX;
+    histogram->max = 0;
+}
+
+void record_histogram(histogram *histogram, uint64_t value)
+{
+    histogram->counts[find_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+uint64_t histogram_percentile(const histogram *histogram, unsigned int per_mille)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (histogram->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank && seen > 0)
+        {
+            // The bound of the bucket may exceed the largest value actually recorded.
+            uint64_t bound = bucket_upper_bound(i);
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void init_monitoring_stats(monitoring_stats *stats, uint64_t now)
+{
+    stats->started_at = now;
+    stats->signals_received = 0;
+    stats->signals_dropped = 0;
+    stats->managed_objects_fetches = 0;
+    stats->properties_fetches = 0;
+    stats->blocks_emitted = 0;
+    stats->blocks_skipped = 0;
+    stats->blocks_superseded = 0;
+    stats->bytes_emitted = 0;
+    stats->reconnections = 0;
+    stats->bluez_restarts = 0;
+    stats->rssi_updates = 0;
+    init_histogram(&stats->emit_latency);
+    init_histogram(&stats->fetch_duration);
+    init_histogram(&stats->fetch_objects);
+}
+
+static void print_histogram(FILE *output, const char *name, const histogram *histogram)
+{
+    if (histogram->count == 0)
+    {
+        fprintf(output, "stats: %s count=0\n", name);
+        return;
+    }
+
+    fprintf(output,
+            "stats: %s count=%" PRIu64 " min=%" PRIu64 " mean=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+            " p99=%" PRIu64 " p999=%" PRIu64 " max=%" PRIu64 "\n",
+            name, histogram->count, histogram->min, histogram->sum / histogram->count,
+            histogram_percentile(histogram, 500), histogram_percentile(histogram, 900),
+            histogram_percentile(histogram, 990), histogram_percentile(histogram, 999), histogram->max);
+}
+
+void print_monitoring_stats(FILE *output, const monitoring_stats *stats, uint64_t now)
+{
+    fprintf(output,
+            "stats: uptime_s=%" PRIu64 " signals=%" PRIu64 " dropped=%" PRIu64 " managed_fetches=%" PRIu64
+            " properties_fetches=%" PRIu64 " blocks=%" PRIu64 " skipped=%" PRIu64 " superseded=%" PRIu64
+            " bytes=%" PRIu64 " reconnections=%" PRIu64 " bluez_restarts=%" PRIu64
+            " rssi_updates=%" PRIu64 "\n",
+            (now - stats->started_at) / 1000000, stats->signals_received, stats->signals_dropped,
+            stats->managed_objects_fetches, stats->properties_fetches, stats->blocks_emitted,
+            stats->blocks_skipped, stats->blocks_superseded, stats->bytes_emitted, stats->reconnections,
+            stats->bluez_restarts, stats->rssi_updates);
+    print_histogram(output, "emit_latency_us", &stats->emit_latency);
+    print_histogram(output, "fetch_duration_us", &stats->fetch_duration);
+    print_histogram(output, "fetch_objects", &stats->fetch_objects);
+    fflush(output);
+}
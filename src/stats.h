@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Values below '1 << HISTOGRAM_PRECISION' are counted exactly, larger ones in buckets whose width
+// grows with the value, so that the relative error stays below '1 / (1 << HISTOGRAM_PRECISION)'.
+#define HISTOGRAM_PRECISION 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_PRECISION + 1) << HISTOGRAM_PRECISION)
+
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} histogram;
+
+// Counters of what the tool did since it started. Updating them only costs a few increments, so
+// they are always enabled.
+typedef struct
+{
+    uint64_t started_at;              // Monotonic time (in microseconds) of the start of the tool.
+    uint64_t signals_received;        // Signals dispatched to one of the handlers.
+    uint64_t signals_dropped;         // Signals about unknown objects, dropped before being parsed.
+    uint64_t managed_objects_fetches; // 'GetManagedObjects' calls.
+    uint64_t properties_fetches;      // 'GetAll' calls for invalidated properties.
+    uint64_t blocks_emitted;          // Blocks of tags given to the output.
+    uint64_t blocks_skipped;          // Blocks not written because identical to the previous one.
+    uint64_t blocks_superseded;       // Blocks dropped before being written, because of a newer one.
+    uint64_t bytes_emitted;           // Bytes given to the output.
+    uint64_t reconnections;           // Connections to the bus dropped after an error.
+    uint64_t bluez_restarts;          // Times BlueZ took its name on the bus again.
+    uint64_t rssi_updates;            // Signals only changing an RSSI, whose printing is rate-limited.
+    histogram emit_latency;           // Microseconds between the first change of a block and its output.
+    histogram fetch_duration;         // Microseconds between a 'GetManagedObjects' call and its reply.
+    histogram fetch_objects;          // Objects parsed from each 'GetManagedObjects' reply.
+} monitoring_stats;
+
+void init_histogram(histogram *histogram);
+
+void record_histogram(histogram *histogram, uint64_t value);
+
+// Upper bound of the bucket holding the given percentile, expressed in thousandths.
+uint64_t histogram_percentile(const histogram *histogram, unsigned int per_mille);
+
+void init_monitoring_stats(monitoring_stats *stats, uint64_t now);
+
+void print_monitoring_stats(FILE *output, const monitoring_stats *stats, uint64_t now);
+
+#endif
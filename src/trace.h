@@ -0,0 +1,22 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Static tracepoints (USDT) for bpftrace, perf or SystemTap, in the 'yambar_bluetooth' provider.
+// When built with 'ENABLE_USDT', each probe is a single 'nop' until a tracer attaches to it.
+// Otherwise they compile to nothing.
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define TRACE(name) DTRACE_PROBE(yambar_bluetooth, name)
+#define TRACE1(name, arg1) DTRACE_PROBE1(yambar_bluetooth, name, arg1)
+#else
+#define TRACE(name) \
+    do              \
+    {               \
+    } while (0)
+#define TRACE1(name, arg1) \
+    do                     \
+    {                      \
+    } while (0)
+#endif
+
+#endif